@@ -0,0 +1,74 @@
+#version 150
+
+// edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), one iteration:
+// a 5x5 b-spline kernel with holes of 2^iteration pixels, each tap weighted 
+// by the similarity of its color, normal, and depth to the center. The first
+// iteration divides the color by the first hit albedo and the last multiplies
+// it again, so only the lighting is blurred. Weights as in atrous() (pathgl.cpp).
+
+uniform sampler2DArray source;  // resolved image or previous iteration
+uniform sampler2DArray albedos; // first hit albedo (rgb)
+uniform sampler2DArray normals; // first hit normal (xyz) and depth (w)
+
+uniform vec4 viewport; // traced resolution (xy)
+uniform int iteration;
+uniform bool last;
+
+in vec2 v_uv;
+flat in int v_layer;
+
+out vec4 fragColor;
+
+const float kernel[3] = float[3](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+
+const float SIGMA_COLOR = 0.5;  // halved per iteration
+const float SIGMA_DEPTH = 0.01; // relative, per pixel of distance
+const float NORMAL_EXPONENT = 64.0;
+
+vec3 demodulate(
+    const in vec3 color
+,   const in vec3 albedo)
+{
+    return iteration == 0 ? color / max(albedo, vec3(0.01)) : color;
+}
+
+void main()
+{
+    ivec3 p = ivec3(gl_FragCoord.xy, v_layer);
+
+    vec4 np = texelFetch(normals, p, 0);
+    vec3 cp = demodulate(texelFetch(source, p, 0).rgb, texelFetch(albedos, p, 0).rgb);
+
+    int step = 1 << iteration;
+    float sigma = SIGMA_COLOR * exp2(-float(iteration));
+
+    vec3 sum = vec3(0.0);
+    float weights = 0.0;
+
+    for(int y = -2; y <= 2; ++y)
+        for(int x = -2; x <= 2; ++x)
+        {
+            ivec3 q = ivec3(p.xy + ivec2(x, y) * step, v_layer);
+            if(any(lessThan(q.xy, ivec2(0))) || any(greaterThanEqual(q.xy, ivec2(viewport.xy))))
+                continue;
+
+            vec4 nq = texelFetch(normals, q, 0);
+            vec3 cq = demodulate(texelFetch(source, q, 0).rgb, texelFetch(albedos, q, 0).rgb);
+
+            vec3 d = cp - cq;
+
+            float w = kernel[abs(x)] * kernel[abs(y)]
+                * exp(-dot(d, d) / (sigma * sigma))
+                * pow(max(dot(np.xyz, nq.xyz), 0.0), NORMAL_EXPONENT)
+                * exp(-abs(np.w - nq.w) / (SIGMA_DEPTH * np.w * length(vec2(x, y) * float(step)) + 1e-4));
+
+            sum += cq * w;
+            weights += w;
+        }
+
+    vec3 color = weights > 0.0 ? sum / weights : cp;
+    if(last)
+        color *= max(texelFetch(albedos, p, 0).rgb, vec3(0.01));
+
+    fragColor = vec4(color, 1.0);
+}
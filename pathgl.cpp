@@ -11,35 +11,135 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
-#include <glm/gtc/random.hpp>
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <cstring>
 #include <vector>
-#include <hash_map>
+#include <map>
 #include <random>
 #include <algorithm>
 #include <iterator>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+#ifdef WIN32
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "pathgl_shared.h"
 
 
 std::mt19937 rng;
 
 // GL_ARRAY_BUFFER for rect vertices
 GLuint rect(-1);
+GLuint vertexarray(-1);
 
-// handles for shaders and program
+// handles for shaders and program (the current variant, see specialize())
 GLuint tracevert(-1);
-GLuint tracefrag(-1);
+GLuint tracegeom(-1);
 GLuint traceprog(-1);
-
-// fbo with texture for floating color attachment
+GLuint resolvefrag(-1);
+GLuint resolveprog(-1);
+
+// ping-pong accumulation: two fbos with layered textures (one layer per 
+// view) holding the sum of all samples (rgb) and their count (alpha). Each
+// pass reads the front target and writes the other one, then they swap.
+GLuint framebuffers[2] = { GLuint(-1), GLuint(-1) };
+GLuint sums[2] = { GLuint(-1), GLuint(-1) };
+int front(0);
+
+// fbo with layered texture the sums are averaged into (resolve), and an fbo 
+// for reading single layers of it (blit and readback)
 GLuint framebuffer(-1);
 GLuint texture(-1);
+GLuint layerbuffer(-1);
 
 // frame counter for iterative accumulation
 int frame(-1);
+int accumulation(0); // seeds the sample sequences of the pixels, drawn on restart (see trace.glsl)
+
+// paths traced per pixel and pass (frame), summed up in the shader
+int samplesPerPass(1);
+
+// path length and backface culling of the tracer, specialized at compile time.
+// Beyond the minimum path length, paths are terminated by russian roulette
+// based on their throughput (disabled if not below the maximum).
+int bounces(4);
+int minBounces(2);
+bool backfaceCulling(true);
+
+// phong exponent of the tall block, 0 keeps it diffuse (see trace.glsl)
+float glossiness(0.f);
+
+// scene constants the tracer is specialized for: triangles are ordered 
+// emitters first (see emitters())
+GLint triangles(0);
+GLint lightTriangles(0);
+
+// emitters are selected for direct lighting by an alias table proportional
+// to their power, or by a light tree by their power over distance
+bool lightTree(false);
+GLint lightTreeLevels(0);
+
+// environment lighting: escaping rays take the radiance of an equirectangular
+// hdr map (y up), which is sampled for direct lighting as well - by the 
+// luminance times the sine of the polar angle of its texels, from an alias 
+// table of the rows and one per row (see sampleEnvironment() in trace.glsl)
+const char * environmentPath(nullptr); // none lights the room by its emitters only
+float environmentScale(1.f);
+bool ceiling(true); // left out to open the room towards the environment
+
+GLuint environmentImage(-1);
+GLuint environmentTable(-1);
+GLuint environmentRows(-1);
+
+// trace program variants, by #define prelude and sources - reused as long
+// as scene, settings and sources match
+std::map<std::string, GLuint> variants;
+
+// program binary cache and background compilation: linked variants are 
+// stored as binaries keyed by a hash of prelude, sources, and driver, and 
+// loaded instead of compiled when available. Reloads compile and link on a
+// worker thread with its own context sharing objects with the main context,
+// and the tracer renders with the current program until the new one linked.
+const char * cacheDir(""); // nullptr disables the binary cache, empty for the per user directory
+std::string driver; // vendor, renderer, and version of the context
+
+#ifdef WIN32
+HDC compileDC(0);
+HGLRC compileContext(0);
+#else
+Display * compileDisplay(nullptr);
+GLXPbuffer compileDrawable(0);
+GLXContext compileContext(0);
+#endif
+
+struct Compilation
+{
+    std::string key;
+    std::string vert;
+    std::string geom;
+    std::string frag;
+    std::string prelude;
+
+    GLuint program; // 0 on failure
+    GLsync fence;
+};
+
+Compilation compilation; // owned by the worker while compiling
+std::thread compiler;
+std::atomic<bool> compiled(false);
+bool reloadPending(false); // update requested while compiling
 
 // camera - taken for cornell box
 glm::vec3 eye   (278.f, 273.f,-800.0f);
@@ -51,24 +151,290 @@ float fovy(143.f);
 
 GLint viewport[2] = { 520, 520 };
 
-// transform storing model view projection for 
-// ray retrieval in vertex shader
-glm::mat4 transform;
+// dynamic resolution: while the camera moves or frames exceed the target,
+// passes are traced into the lower left part of the accumulation texture 
+// only, scaled such that the measured frame time meets the target, and 
+// upscaled for display. Static views return to native resolution once the
+// camera was static for a while, unless native frames would miss the target.
+float targetFrameTime(0.f); // milliseconds, 0 disables scaling
+float minScale(0.25f);
+int settleTime(250); // milliseconds without camera change until static
+
+float resolutionScale(1.f);
+GLint resolution[2] = { 520, 520 }; // traced part of the viewport
+
+float frameTime(0.f); // smoothed milliseconds between displayed frames
+int lastDisplay(0);
+int lastMove(-1); // elapsed time of the last camera change
+
+// multiple views traced in one pass, each into its own layer with rays
+// generated per layer in the geometry shader (see trace.geom)
+enum ViewLayout { SingleView, StereoViews, CubemapViews, LightfieldViews };
+
+static const int MAX_VIEWS = 16; // as in trace.geom
+
+ViewLayout viewLayout(SingleView);
+int views(1);
+float viewSpacing(0.f); // stereo separation or lightfield grid spacing
+
+std::vector<glm::mat4> transforms;
+std::vector<glm::vec3> eyes;
+
+// poster mode: images beyond texture size limits are rendered as grid of
+// tiles, each traced with a sub-frustum of the same camera and streamed 
+// into the output file when done - the accumulation target is one tile
+GLint poster[2] = { 0, 0 };
+GLint posterTile(512);
+int posterSamples(256);
+const char * posterOutput(nullptr);
+bool halfFloat(false); // RGBA16F resolved image (sums are always RGBA32F)
+
+int tile(0); // index of the tile in progress, row by row from bottom left
+glm::vec4 region(1.f, 1.f, 0.f, 0.f); // of the tile, scale (xy) and offset (zw) in ndc
+
+// time budgeted dispatch: a pass is split into scissored tiles, and each
+// displayed frame traces as many as fit into the budget - the remainder is
+// carried over to the next frame. Tile costs are measured by timer queries
+// (read back when available, never waited for), tiles closer to the screen
+// center are traced first.
+struct DispatchTile
+{
+    GLint x, y, w, h;
+    float cost; // estimated milliseconds
+    bool converged; // noise below the adaptive threshold, skipped until clear
+};
+
+float budget(0.f); // milliseconds per displayed frame, 0 for full passes
+GLint budgetTile(64); // dispatch tile size, for budget and adaptive sampling
+
+std::vector<DispatchTile> dispatchTiles;
+std::vector<size_t> dispatchOrder;
+size_t dispatchNext(0); // position in dispatch order of the next tile of the pass
+
+std::vector<GLuint> queries; // unused timer queries
+std::deque<std::pair<GLuint, size_t> > pendingQueries; // query and tile
+
+// adaptive sampling: the second moment of the path luminance is accumulated
+// alongside the sums (ping-pong as well), and resolve estimates per pixel the
+// noise - standard error of the mean relative to its square root, i.e., of 
+// the gamma 2 encoded value. The estimate is read back asynchronously every
+// few passes, and tiles whose rms noise is below the threshold are skipped
+// by the dispatch. Jobs and poster tiles finish once all tiles converged.
+float noiseThreshold(0.f); // 0 disables adaptive sampling
+int noiseMinSamples(16); // before estimates are trusted
+int noiseInterval(4); // passes between estimates
+
+GLuint moments[2] = { GLuint(-1), GLuint(-1) };
+GLuint noise(-1); // layered as the resolved texture, attached to its fbo
+
+GLuint noisePBO(-1);
+GLsync noiseFence(0);
+GLint noisePending[2] = { 0, 0 }; // width, height of pending readback
+int noiseFrame(-1); // frame of the last readback
+
+long long tracedPaths(0); // since clear, for the samples per pixel on average
+
+// denoising: the tracer also writes albedo, normal, and depth of the first 
+// hit per pixel into feature textures (attached to both ping-pong targets),
+// guiding an edge-avoiding a-trous filter of the resolved image before it is
+// shown or exported (see denoise.frag). Workers spool raw sums and features,
+// the coordinator filters the merged image on the cpu instead (atrous()).
+int denoiseIterations(0); // 0 disables denoising
+
+GLuint albedos(-1);
+GLuint normals(-1); // and depth (w)
+
+GLuint denoisefrag(-1);
+GLuint denoiseprog(-1);
+
+GLuint filtered[2] = { GLuint(-1), GLuint(-1) }; // iterations alternate
+GLuint filterbuffers[2] = { GLuint(-1), GLuint(-1) };
+
+GLuint shown(-1); // texture displayed and read back, resolved or denoised
+
+// temporal reprojection: camera changes carry the accumulation over instead
+// of clearing it. The first hit of each pixel in the new view is projected
+// into the previous view, whose sums are taken if the first hit features 
+// stored there match in depth and normal - down-weighted to a maximum 
+// history, so the new view takes over soon. Other pixels restart.
+int reprojectHistory(0); // samples kept at most, 0 disables reprojection
+
+GLuint reprojectfrag(-1);
+GLuint reprojectprog(-1);
+GLuint reprojectbuffer(-1); // back target without features, read meanwhile
+
+bool featureBuffers(false); // first hit features traced, for denoising or reprojection
+
+// hybrid primary visibility: the first hits are rasterized once per camera
+// change into a g-buffer of position and triangle (see primary.vert), and
+// paths start there instead of tracing their primary ray against the whole
+// scene. Several variants jitter the pixel center, the samples cycle through
+// them for antialiasing.
+int primaryVariants(0); // 0 traces primary rays
+
+GLuint primaryvert(-1);
+GLuint primaryfrag(-1);
+GLuint primaryprog(-1);
+GLuint primarybuffer(-1);
+GLuint primaryarray(-1); // without attributes, vertices are fetched by id
+
+GLuint hits(-1); // position (xyz) and triangle + 1 (w), layers of variants per view
+GLuint hitDepth(-1);
+
+bool rasterized(false); // g-buffer of the current camera
+
+// resampled direct lighting (ReSTIR, see resample() in trace.frag): at the 
+// first hit, candidates of the emitter sampling are resampled by their
+// unshadowed contribution into a reservoir per pixel, combined with the 
+// reservoirs of the previous pass at the pixel and its neighbors, and only 
+// the sample kept is tested for visibility. Reservoirs are ping-pong targets
+// alongside the sums (cleared with them), read from the front.
+int restirCandidates(0); // per pixel and pass, 0 disables resampling
+
+GLuint reservoirs[2] = { GLuint(-1), GLuint(-1) };      // sample (xyz) and weight (w)
+GLuint reservoirCounts[2] = { GLuint(-1), GLuint(-1) }; // candidates, emitter, depth and triangle of the first hit
+
+// wavefront tracer (GL 4.3, see wavefront.comp): paths are traced by compute
+// stages - generate, extend (intersection), shade, connect (shadow rays) - 
+// that communicate via queues of path indices in shader storage buffers, 
+// compacted by atomic counters and dispatched indirectly. Terminated or 
+// diverging paths thus do not idle the lanes of the remaining ones.
+enum WavefrontStage { Generate, Extend, Shade, Connect, Accumulate, Arguments, WAVEFRONT_STAGES };
+static const char * wavefrontDefines[WAVEFRONT_STAGES] = { "GENERATE", "EXTEND", "SHADE", "CONNECT", "ACCUMULATE", "ARGUMENTS" };
+
+enum WavefrontQueue { Extensions = 0, Hits = 2, Shadows = 3 }; // two extension queues, as in wavefront.comp
+
+bool wavefront(false);
+GLuint wavefrontprogs[WAVEFRONT_STAGES]; // 0 until compiled
+
+GLuint wavefrontPaths(-1);
+GLuint wavefrontQueues(-1);
+GLuint wavefrontShadows(-1);
+GLuint wavefrontCounters(-1);
+GLint wavefrontCapacity(0); // paths the buffers were allocated for
+
+// path guiding (GL 4.3, see GUIDING in trace.frag): bounces are sampled from
+// a directional distribution per cell of a spatial hash grid over the scene,
+// mixed with brdf sampling. The distributions are trained by the paths of all
+// passes and snapshot for sampling after 1, 2, 4, ... passes and every 64 
+// beyond (see guide.comp) - kept across camera changes, as the scene is.
+int guideResolution(0); // cells per axis of the scene bounds, 0 disables guiding
+
+const GLint GUIDE_SLOTS(1 << 14); // of the hash table, a power of two
+const GLint GUIDE_BINS(64);       // per cell, as in trace.frag
+const GLint GUIDE_FRACTIONS(4);   // candidates of the bounces sampled from the guide, as in trace.frag
+
+glm::vec3 guideOrigin;
+float guideCell(0.f);
+GLint guidePasses(0);
+
+GLuint guidecomp(-1);
+GLuint guideprog(-1);
+GLuint guideKeys(-1);
+GLuint guideTraining(-1);
+GLuint guideLearned(-1);
+
+// radiance cache (GL 4.3, see RADIANCE_CACHE in trace.frag): the radiance 
+// reflected by diffuse surfaces at a given bounce is averaged per cell of a 
+// second hash grid, trained by some of the paths and snapshot before each pass
+// (see cache.comp) - the others end there in trained cells. Kept across 
+// camera changes, dropped when the trace program changes (see invalidate()).
+int cacheResolution(0); // cells per axis of the scene bounds, 0 disables the cache
+int cacheBounce(2);     // vertex of the paths ending in the cache, 0 being the first hit
+
+const GLint CACHE_SLOTS(1 << 16); // of the hash table, a power of two
+
+glm::vec3 cacheOrigin;
+float cacheCell(0.f);
+
+GLuint cachecomp(-1);
+GLuint cacheprog(-1);
+GLuint cacheKeys(-1);
+GLuint cacheTraining(-1);
+GLuint cacheLearned(-1);
+GLuint cacheProgram(0); // trace program the cache and guide were trained with
 
 // texture handler - TODO: try using images instead
 GLuint verticesImage(-1);
 GLuint indicesImage(-1);
-GLuint colorsImage(-1);
-GLuint hsphereImage(-1);
-GLuint lightsImage(-1);
+GLuint materialsImage(-1);
+GLuint emittersImage(-1);
+GLuint lightTreeImage(-1);
 
 // uniform handler
 GLuint u_frame(-1);
-GLuint u_accum(-1);
-GLuint u_eye(-1);
-GLuint u_transform(-1);
+GLuint u_eyes(-1);
+GLuint u_transforms(-1);
+GLuint u_views(-1);
+GLuint u_tile(-1);
 GLuint u_viewport(-1);
-GLuint u_rand(-1);
+GLuint u_accumulation(-1);
+GLuint u_moments(-1);
+GLuint u_reservoirs(-1);
+GLuint u_reservoirCounts(-1);
+
+// run without showing the window (e.g., for jobs only observed via viewers)
+bool headless(false);
+
+// shared memory framebuffer published for out-of-process viewers, see
+// pathgl_viewer.cpp - readback is asynchronous via pbo and a fence, that
+// is collected on a later frame only if complete, so rendering never waits.
+const char * shmName(nullptr);
+int shmInterval(33); // milliseconds between publishes
+
+SharedFramebuffer * shm(nullptr);
+GLuint shmPBO(-1);
+GLsync shmFence(0);
+GLint shmPending[3] = { 0, 0, -1 }; // width, height, frame of pending readback
+int shmLast(0);
+
+// distributed rendering via spool directory: workers render batches of 
+// independently seeded samples and drop them as sum-and-count buffers (RGBA32F,
+// rgb as sum and alpha as sample count) into the spool. The coordinator merges
+// them incrementally and marks the spool as done when finished.
+const char * spool(nullptr);
+bool coordinator(false);
+
+int batchSamples(64);  // samples per pixel of a worker batch
+int targetSamples(0);  // samples per pixel the coordinator waits for, 0 for endless
+int batch(0);
+
+unsigned long seed(0);
+
+// image written by the coordinator when done
+const char * output(nullptr);
+
+// batch mode: jobs (camera, samples, output) rendered back-to-back, reusing
+// context, program, and scene - only the accumulation is reset in between.
+struct Job
+{
+    glm::vec3 eye;
+    glm::vec3 center;
+    float fovy;
+    int samples;
+    std::string output;
+};
+
+const char * jobFile(nullptr);
+std::vector<Job> jobs;
+size_t job(0);
+int jobStart(0); // elapsed time at job start
+
+// images are written on a background thread, so disk i/o of a finished job
+// overlaps tracing of the next one
+struct Image
+{
+    std::string filepath;
+    GLint width;
+    GLint height;
+    std::vector<float> pixels;
+};
+
+std::thread writer;
+std::mutex writerMutex;
+std::condition_variable writerCondition;
+std::deque<Image> writerQueue;
+bool writerDone(false);
 
 // opengl error handling with debug info
 const bool error(
@@ -107,24 +473,33 @@ void glShaderError(const GLuint shader)
         std::cerr << "GLSL: " << log << std::endl;
 }
 
-// dumps text file into shader
+// dumps text file into string, empty on failure
 
-void updateSource(
-	const GLuint shader
-,	const char * filepath)
+const std::string readSource(const char * filepath)
 {
 	std::ifstream stream(filepath, std::ios::in);
 	if(!stream)
 	{
         std::cerr << "Read from \"" << filepath << "\" failed." << std::endl;
-        return;
+        return std::string();
     }
 
 	std::ostringstream source;
     source << stream.rdbuf();
     stream.close();
 
-    const std::string str(source.str());
+    return source.str();
+}
+
+// compiles source into shader, with the prelude inserted after the version directive
+
+void compileSource(
+	const GLuint shader
+,	const std::string & source
+,   const std::string & prelude)
+{
+    const size_t version(0 == source.compare(0, 8, "#version") ? source.find('\n') + 1 : 0);
+    const std::string str(source.substr(0, version) + prelude + source.substr(version));
     const GLchar * chr(str.c_str());
 
     glShaderSource(shader, 1, &chr, nullptr);
@@ -134,60 +509,464 @@ void updateSource(
 	glShaderError(shader);
 }
 
-// clears the accumulation texture and resets frame number
-void clear()
+// dumps text file into shader
+
+void updateSource(
+	const GLuint shader
+,	const char * filepath)
+{
+    const std::string source(readSource(filepath));
+    if(!source.empty())
+        compileSource(shader, source, std::string());
+}
+
+// transposed model view projection, used for ray retrieval
+const glm::mat4 camera(
+    const glm::vec3 & eye
+,   const glm::vec3 & center
+,   const glm::vec3 & up
+,   const float fovy)
+{
+    const glm::vec2 viewportf(poster[0] ? poster[0] : viewport[0], poster[0] ? poster[1] : viewport[1]);
+
+    const glm::mat4 projection(glm::perspective(fovy, viewportf.y / viewportf.x, 1.f, 2000.f));
+    const glm::mat4 view(glm::lookAt(eye, center, up));
+
+    return glm::transpose(projection * view * glm::mat4(1));
+}
+
+// derives the transforms and eyes of all views from the camera at the eye 
+// looking at the center: stereo pairs and lightfield grids are parallel 
+// cameras offset in the image plane, cube maps are the six axis aligned faces
+// around the eye (fovy of 90 degrees).
+void cameras(
+    const glm::vec3 & eye
+,   const glm::vec3 & center)
+{
+    transforms.resize(views);
+    eyes.resize(views);
+
+    const glm::vec3 f(glm::normalize(center - eye));
+    const glm::vec3 s(glm::normalize(glm::cross(f, up)));
+    const glm::vec3 u(glm::cross(s, f));
+
+    switch(viewLayout)
+    {
+    case StereoViews:
+    case LightfieldViews:
+        {
+            const int columns(StereoViews == viewLayout ? 2 : static_cast<int>(sqrtf(static_cast<float>(views)) + 0.5f));
+            const int rows(views / columns);
+
+            for(int i = 0; i < views; ++i)
+            {
+                const glm::vec3 offset(s * ((i % columns) - (columns - 1) * 0.5f) * viewSpacing
+                                     + u * ((i / columns) - (rows    - 1) * 0.5f) * viewSpacing);
+                eyes[i] = eye + offset;
+                transforms[i] = camera(eyes[i], center + offset, up, fovy);
+            }
+        }
+        break;
+
+    case CubemapViews:
+        {
+            static const glm::vec3 faces[6][2] = { 
+                { glm::vec3( 1, 0, 0), glm::vec3(0,-1, 0) }, { glm::vec3(-1, 0, 0), glm::vec3(0,-1, 0) }
+            ,   { glm::vec3( 0, 1, 0), glm::vec3(0, 0, 1) }, { glm::vec3( 0,-1, 0), glm::vec3(0, 0,-1) }
+            ,   { glm::vec3( 0, 0, 1), glm::vec3(0,-1, 0) }, { glm::vec3( 0, 0,-1), glm::vec3(0,-1, 0) } };
+
+            for(int i = 0; i < views; ++i)
+            {
+                eyes[i] = eye;
+                transforms[i] = camera(eye, eye + faces[i][0], faces[i][1], 90.f);
+            }
+        }
+        break;
+
+    default:
+        eyes[0] = eye;
+        transforms[0] = camera(eye, center, up, fovy);
+    }
+}
+
+// resets frame number and pass dispatch, drops the noise estimates
+void restart()
 {
     frame = -1;
+    dispatchNext = 0;
+
+    accumulation = static_cast<int>(rng() >> 1); // decorrelates from previous accumulations
+
+    // estimates of the previous accumulation are dropped
+
+    for(size_t i = 0; i < dispatchTiles.size(); ++i)
+        dispatchTiles[i].converged = false;
+
+    if(noiseFence)
+        glDeleteSync(noiseFence);
+    noiseFence = 0;
+    noiseFrame = -1;
+    tracedPaths = 0;
+}
+
+// applies the camera to the tracer: transforms and eyes of all views, and 
+// the region of the current poster tile
+void look()
+{
+    // orbit of the eye around the center (left and right keys), the origin 
+    // of the rays of all views
+
+    const float a(glm::radians(angle));
+    const glm::vec3 d(eye - center);
+
+    cameras(center + glm::vec3(d.x * cosf(a) + d.z * sinf(a), d.y, d.z * cosf(a) - d.x * sinf(a)), center);
+
+    if(u_transforms != -1)
+        glUniformMatrix4fv(u_transforms, views, GL_FALSE, glm::value_ptr(transforms[0]));   
+    if(u_eyes != -1)
+        glUniform3fv(u_eyes, views, glm::value_ptr(eyes[0]));
+    if(u_views != -1)
+        glUniform1i(u_views, views);
+
+    // region of the current tile in normalized device coordinates
+
+    region = glm::vec4(1.f, 1.f, 0.f, 0.f);
+    if(poster[0])
+    {
+        const GLint columns((poster[0] + posterTile - 1) / posterTile);
+        const glm::vec2 scale(static_cast<float>(posterTile) / glm::vec2(poster[0], poster[1]));
+        const glm::vec2 origin(static_cast<float>(tile % columns), static_cast<float>(tile / columns));
+
+        region = glm::vec4(scale, (origin * 2.f + 1.f) * scale - 1.f);
+    }
+    if(u_tile != -1)
+        glUniform4fv(u_tile, 1, glm::value_ptr(region));
+
+    rasterized = false;
+}
+
+// clears the accumulation textures and resets frame number, applies the camera
+void clear()
+{
+    restart();
 
+    for(int i = 0; i < 2; ++i)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
     glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
     glClear(GL_COLOR_BUFFER_BIT);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    const glm::vec2 viewportf(viewport[0], viewport[1]);
+    look();
+}
+
+// returns the #define prelude specializing the tracer for current scene and 
+// settings, so the compiler can unroll the loops over triangles, bounces, and
+// samples, and strip disabled features
+const std::string specialize()
+{
+    std::ostringstream prelude;
+    prelude << "#define TRIANGLES "       << triangles      << "\n"
+            << "#define LIGHT_TRIANGLES " << lightTriangles << "\n"
+            << "#define BOUNCES "         << bounces        << "\n"
+            << "#define SAMPLES "         << samplesPerPass << "\n";
+    if(minBounces < bounces)
+        prelude << "#define MIN_BOUNCES " << minBounces << "\n";
+    if(backfaceCulling)
+        prelude << "#define BACKFACE_CULLING\n";
+    if(lightTree)
+        prelude << "#define LIGHT_TREE "  << lightTreeLevels << "\n";
+    if(restirCandidates > 0)
+        prelude << "#define RESTIR "      << restirCandidates << "\n";
+    if(environmentPath)
+        prelude << "#define ENVIRONMENT\n";
+    if(guideResolution > 0 || cacheResolution > 0)
+        prelude << "#extension GL_ARB_shader_storage_buffer_object : require\n";
+    if(guideResolution > 0)
+        prelude << "#define GUIDING "      << GUIDE_SLOTS << "\n"
+                << "#define GUIDE_ORIGIN vec3(" << guideOrigin.x << ", " << guideOrigin.y << ", " << guideOrigin.z << ")\n"
+                << "#define GUIDE_CELL float(" << guideCell << ")\n";
+    if(cacheResolution > 0)
+        prelude << "#define RADIANCE_CACHE " << CACHE_SLOTS << "\n"
+                << "#define CACHE_BOUNCE "   << cacheBounce << "\n"
+                << "#define CACHE_ORIGIN vec3(" << cacheOrigin.x << ", " << cacheOrigin.y << ", " << cacheOrigin.z << ")\n"
+                << "#define CACHE_CELL float(" << cacheCell << ")\n";
+    if(noiseThreshold > 0.f)
+        prelude << "#define ADAPTIVE\n";
+    if(featureBuffers)
+        prelude << "#define FEATURES\n";
+    if(primaryVariants > 0)
+        prelude << "#define PRIMARY_VARIANTS " << primaryVariants << "\n";
+
+    return prelude.str();
+}
 
-    glm::vec3 c(center);
-//    e.x = (cos(angle) - sin(angle)) * (center.z - eye.z) + center.x;
-    //e.z = (sin(angle) + cos(angle)) * (center.z - eye.z) + center.z;
-    c.x += 50;
+// 64 bit fnv-1a, stable across runs (other than std::hash)
+const std::uint64_t fnv1a(const std::string & str)
+{
+    std::uint64_t hash(14695981039346656037ull);
+    for(size_t i = 0; i < str.size(); ++i)
+        hash = (hash ^ static_cast<unsigned char>(str[i])) * 1099511628211ull;
+    return hash;
+}
 
-    glm::vec3 e(eye);
-    e.x += 50;
+// returns the per user directory of the binary cache, created if missing:
+// $XDG_CACHE_HOME/pathgl or ~/.cache/pathgl (%LOCALAPPDATA%\pathgl on 
+// windows) - nullptr if the environment names none
+const char * userCacheDir()
+{
+    static std::string dir;
 
-    const glm::mat4 projection(glm::perspective(fovy, viewportf.y / viewportf.x, 1.f, 2000.f));
-    const glm::mat4 view(glm::lookAt(e, c, up));
+#ifdef WIN32
+    const char * base(getenv("LOCALAPPDATA"));
+    if(!base || !*base)
+        return nullptr;
 
-    transform = projection * view * glm::mat4(1);
-    transform = glm::transpose(transform);
+    dir = std::string(base) + "\\pathgl";
+    _mkdir(dir.c_str());
+#else
+    const char * base(getenv("XDG_CACHE_HOME"));
+    const char * home(getenv("HOME"));
+
+    if(base && *base)
+        dir = base;
+    else if(home && *home)
+        dir = std::string(home) + "/.cache";
+    else
+        return nullptr;
+
+    mkdir(dir.c_str(), 0755);
+    dir += "/pathgl";
+    mkdir(dir.c_str(), 0755);
+#endif
+    return dir.c_str();
+}
 
-    if(u_transform != -1)
-        glUniformMatrix4fv(u_transform, 1, GL_FALSE, glm::value_ptr(transform));   
+const std::string binaryPath(const std::string & key)
+{
+    std::ostringstream path;
+    path << cacheDir << "/trace-" << std::hex << fnv1a(driver + key) << ".bin";
+    return path.str();
 }
 
-// updates shader sources, and reinitializes uniforms
-void update()
+// loads a variant from the binary cache - returns 0 if not cached or if the
+// driver rejects the binary (e.g., after driver updates)
+const GLuint loadBinary(const std::string & key)
+{
+    if(!cacheDir || !GLEW_ARB_get_program_binary)
+        return 0;
+
+    std::ifstream stream(binaryPath(key).c_str(), std::ios::in | std::ios::binary);
+    if(!stream)
+        return 0;
+
+    GLenum format(0);
+    stream.read(reinterpret_cast<char *>(&format), sizeof(format));
+
+    const std::vector<char> binary((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    if(!stream || binary.empty())
+        return 0;
+
+    const GLuint program(glCreateProgram());
+    glProgramBinary(program, format, &binary[0], static_cast<GLsizei>(binary.size()));
+
+    GLint status(GL_FALSE);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    glGetError(); // unsupported formats are not worth reporting
+
+    if(GL_TRUE == status)
+        return program;
+
+    glDeleteProgram(program);
+    return 0;
+}
+
+void storeBinary(
+    const GLuint program
+,   const std::string & key)
+{
+    if(!cacheDir || !GLEW_ARB_get_program_binary)
+        return;
+
+    GLint length(0);
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0)
+        return;
+
+    std::vector<char> binary(length);
+    GLenum format(0);
+    glGetProgramBinary(program, length, nullptr, &format, &binary[0]);
+    glError();
+
+    const std::string path(binaryPath(key));
+    std::ofstream stream(path.c_str(), std::ios::out | std::ios::binary);
+    stream.write(reinterpret_cast<const char *>(&format), sizeof(format));
+    stream.write(&binary[0], binary.size());
+
+    if(!stream)
+        std::cerr << "Write to \"" << path << "\" failed." << std::endl;
+}
+
+// compiles and links a variant with its own shader objects, and stores it in 
+// the binary cache - returns 0 on failure. Runs on main and worker context.
+const GLuint build(const Compilation & variant)
+{
+    const GLuint shaders[3] = { glCreateShader(GL_VERTEX_SHADER), glCreateShader(GL_GEOMETRY_SHADER), glCreateShader(GL_FRAGMENT_SHADER) };
+
+    compileSource(shaders[0], variant.vert, std::string());
+    compileSource(shaders[1], variant.geom, std::string());
+    compileSource(shaders[2], variant.frag, variant.prelude);
+
+    const GLuint program(glCreateProgram());
+    for(int i = 0; i < 3; ++i)
+        glAttachShader(program, shaders[i]);
+
+    if(cacheDir && GLEW_ARB_get_program_binary)
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+    glBindAttribLocation(program, 0, "a_vertex");
+    glBindFragDataLocation(program, 0, "fragColor");
+    glBindFragDataLocation(program, 1, "fragMoment");
+    glBindFragDataLocation(program, 2, "fragAlbedo");
+    glBindFragDataLocation(program, 3, "fragNormal");
+    glBindFragDataLocation(program, 4, "fragReservoir");
+    glBindFragDataLocation(program, 5, "fragReservoirCount");
+    glLinkProgram(program);
+
+    for(int i = 0; i < 3; ++i)
+    {
+        glDetachShader(program, shaders[i]);
+        glDeleteShader(shaders[i]);
+    }
+    glError();
+
+    GLint status(GL_FALSE);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(GL_TRUE != status)
+    {
+        std::cerr << "Linking trace program failed." << std::endl;
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    storeBinary(program, variant.key);
+    return program;
+}
+
+// creates the context of the compile worker, sharing objects with the 
+// current context - returns false if unsupported
+bool createCompileContext()
+{
+    const bool storage(wavefront || guideResolution > 0 || cacheResolution > 0); // as the main context, see main()
+
+#ifdef WIN32
+    if(!WGLEW_ARB_create_context)
+        return false;
+
+    const int attribs[] = { WGL_CONTEXT_MAJOR_VERSION_ARB, storage ? 4 : 3, WGL_CONTEXT_MINOR_VERSION_ARB, storage ? 3 : 2
+        , WGL_CONTEXT_PROFILE_MASK_ARB, WGL_CONTEXT_CORE_PROFILE_BIT_ARB, 0 };
+
+    compileDC = wglGetCurrentDC();
+    compileContext = wglCreateContextAttribsARB(compileDC, wglGetCurrentContext(), attribs);
+#else
+    if(!GLXEW_ARB_create_context)
+        return false;
+
+    compileDisplay = glXGetCurrentDisplay();
+
+    const int configAttribs[] = { GLX_DRAWABLE_TYPE, GLX_PBUFFER_BIT, None };
+    int count(0);
+
+    GLXFBConfig * configs(glXChooseFBConfig(compileDisplay, XDefaultScreen(compileDisplay), configAttribs, &count));
+    if(!configs || !count)
+        return false;
+
+    const int pbufferAttribs[] = { GLX_PBUFFER_WIDTH, 1, GLX_PBUFFER_HEIGHT, 1, None };
+    const int attribs[] = { GLX_CONTEXT_MAJOR_VERSION_ARB, storage ? 4 : 3, GLX_CONTEXT_MINOR_VERSION_ARB, storage ? 3 : 2
+        , GLX_CONTEXT_PROFILE_MASK_ARB, GLX_CONTEXT_CORE_PROFILE_BIT_ARB, None };
+
+    compileDrawable = glXCreatePbuffer(compileDisplay, configs[0], pbufferAttribs);
+    compileContext = glXCreateContextAttribsARB(compileDisplay, configs[0], glXGetCurrentContext(), True, attribs);
+    XFree(configs);
+#endif
+    return 0 != compileContext;
+}
+
+void makeCompileContextCurrent(const bool current)
+{
+#ifdef WIN32
+    wglMakeCurrent(current ? compileDC : 0, current ? compileContext : 0);
+#else
+    glXMakeContextCurrent(compileDisplay, current ? compileDrawable : None, current ? compileDrawable : None, current ? compileContext : 0);
+#endif
+}
+
+// worker: builds the pending compilation on its own context, fenced so the 
+// main context sees the complete program
+void compileInBackground()
+{
+    makeCompileContextCurrent(true);
+
+    compilation.program = build(compilation);
+    compilation.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+
+    makeCompileContextCurrent(false);
+    compiled.store(true, std::memory_order_release);
+}
+
+void joinCompiler()
+{
+    if(compiler.joinable())
+        compiler.join();
+}
+
+// drops the radiance cache and the guide trained so far, as the scene or the
+// tracer changed (e.g., sources reloaded on f5)
+void invalidate()
 {
+    cacheProgram = traceprog;
+
+    const GLuint buffers[6] = { guideKeys, guideTraining, guideLearned, cacheKeys, cacheTraining, cacheLearned };
+    for(int i = 0; i < 6; ++i)
+    {
+        if(-1 == buffers[i])
+            continue;
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[i]);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
     glError();
 
-    updateSource(tracevert, "trace.vert");
-    updateSource(tracefrag, "trace.frag");
+    guidePasses = 0;
+}
+
+// sets up uniforms of the given trace program and uses it from now on
+void adopt(const GLuint program)
+{
+    traceprog = program;
 
-    glLinkProgram(traceprog);
     glUseProgram(traceprog);
     glError();
 
 	// assign uniforms
 
-    u_transform = glGetUniformLocation(traceprog, "transform");
+    u_transforms= glGetUniformLocation(traceprog, "transforms");
+    u_eyes      = glGetUniformLocation(traceprog, "eyes");
+    u_views     = glGetUniformLocation(traceprog, "views");
+    u_tile      = glGetUniformLocation(traceprog, "tile");
     u_frame     = glGetUniformLocation(traceprog, "frame");
-	u_rand      = glGetUniformLocation(traceprog, "rand");
-    u_accum     = glGetUniformLocation(traceprog, "accum");
-    u_eye       = glGetUniformLocation(traceprog, "eye");
+    u_accumulation = glGetUniformLocation(traceprog, "accumulation");
     u_viewport  = glGetUniformLocation(traceprog, "viewport");
+    u_moments   = glGetUniformLocation(traceprog, "moments");
+    u_reservoirs      = glGetUniformLocation(traceprog, "reservoirs");
+    u_reservoirCounts = glGetUniformLocation(traceprog, "reservoirCounts");
 
-    const glm::vec2 viewportf(viewport[0], viewport[1]);
+    const glm::vec2 viewportf(resolution[0], resolution[1]);
 
-    if(u_eye != -1)
-        glUniform3fv(u_eye, 1, glm::value_ptr(eye));
     if(u_viewport != -1)
         glUniform4f(u_viewport, viewportf.x, viewportf.y, 1.f / viewportf.x, 1.f / viewportf.y);
 
@@ -196,10 +975,11 @@ void update()
 
 	GLuint u_vertices = glGetUniformLocation(traceprog, "vertices");
 	GLuint u_indices  = glGetUniformLocation(traceprog, "indices");
-	GLuint u_colors   = glGetUniformLocation(traceprog, "colors");
+	GLuint u_materials = glGetUniformLocation(traceprog, "materials");
+	GLuint u_emitters  = glGetUniformLocation(traceprog, "emitters");
+	GLuint u_lightTree = glGetUniformLocation(traceprog, "lightTree");
     GLuint u_source   = glGetUniformLocation(traceprog, "source");
-    GLuint u_hsphere  = glGetUniformLocation(traceprog, "hsphere");
-	GLuint u_lights   = glGetUniformLocation(traceprog, "lights");
+    GLuint u_primary  = glGetUniformLocation(traceprog, "primary");
 
 	if(u_source != -1)
 		glUniform1i(u_source,   0);
@@ -207,70 +987,1732 @@ void update()
 		glUniform1i(u_vertices, 1);
 	if(u_indices != -1)
 		glUniform1i(u_indices,  2);
-	if(u_colors != -1)
-		glUniform1i(u_colors,   3);
-    if(u_hsphere != -1)
-        glUniform1i(u_hsphere,  4);
-	if(u_lights != -1)
-		glUniform1i(u_lights,   5);
+	if(u_materials != -1)
+		glUniform1i(u_materials, 3);
+	if(u_emitters != -1)
+		glUniform1i(u_emitters, 4);
+	if(u_lightTree != -1)
+		glUniform1i(u_lightTree, 5);
+	if(environmentPath)
+	{
+		glUniform1i(glGetUniformLocation(traceprog, "environment"), 19);
+		glUniform1i(glGetUniformLocation(traceprog, "environmentTable"), 20);
+		glUniform1i(glGetUniformLocation(traceprog, "environmentRows"), 21);
+	}
+    if(u_primary != -1)
+        glUniform1i(u_primary, 14);
 
 
     glError();
 
+    if(cacheProgram != traceprog)
+        invalidate();
+
     clear();
 }
 
-// resizes viewport and accumulation texture, configures the camera/view
-void on_reshape(int w, int h)
+// compiles the stages of the wavefront tracer, with the prelude of the trace
+// program and a define selecting the stage
+void updateWavefront(const std::string & prelude)
+{
+    const std::string source(readSource("wavefront.comp"));
+
+    for(int i = 0; i < WAVEFRONT_STAGES; ++i)
+    {
+        if(wavefrontprogs[i])
+            glDeleteProgram(wavefrontprogs[i]);
+
+        const GLuint shader(glCreateShader(GL_COMPUTE_SHADER));
+        compileSource(shader, source, "#define " + std::string(wavefrontDefines[i]) + "\n" + prelude);
+
+        const GLuint program(glCreateProgram());
+        glAttachShader(program, shader);
+        glLinkProgram(program);
+        glDetachShader(program, shader);
+        glDeleteShader(shader);
+        glError();
+
+        glProgramUniform1i(program, glGetUniformLocation(program, "source"),   0);
+        glProgramUniform1i(program, glGetUniformLocation(program, "vertices"), 1);
+        glProgramUniform1i(program, glGetUniformLocation(program, "indices"),  2);
+        glProgramUniform1i(program, glGetUniformLocation(program, "materials"), 3);
+        glProgramUniform1i(program, glGetUniformLocation(program, "emitters"), 4);
+        glProgramUniform1i(program, glGetUniformLocation(program, "lightTree"), 5);
+        glProgramUniform1i(program, glGetUniformLocation(program, "environment"), 19);
+        glProgramUniform1i(program, glGetUniformLocation(program, "environmentTable"), 20);
+        glProgramUniform1i(program, glGetUniformLocation(program, "environmentRows"), 21);
+        glProgramUniform1i(program, glGetUniformLocation(program, "target"),   0); // image units
+        glProgramUniform1i(program, glGetUniformLocation(program, "albedos"),  1);
+        glProgramUniform1i(program, glGetUniformLocation(program, "normals"),  2);
+        glError();
+
+        wavefrontprogs[i] = program;
+    }
+}
+
+// updates shader sources, and reinitializes uniforms. The trace program is 
+// taken from the variants or the binary cache if available, and otherwise 
+// compiled in background (if supported and a program is in use already).
+void update()
 {
+    if(compiler.joinable()) // reloaded when the current compilation is done
+    {
+        reloadPending = true;
+        return;
+    }
+    glError();
+
+    Compilation variant;
+    variant.vert = readSource("trace.vert");
+    variant.geom = readSource("trace.geom");
+    variant.frag = readSource("trace.frag");
+    variant.prelude = specialize() + readSource("trace.glsl");
+    variant.key = variant.prelude + variant.vert + variant.geom + variant.frag;
+    variant.program = 0;
+    variant.fence = 0;
+
+    // resolve shares vertex and geometry shader, thus the vertex attribute
+
+    compileSource(tracevert, variant.vert, std::string());
+    compileSource(tracegeom, variant.geom, std::string());
+    updateSource(resolvefrag, "resolve.frag");
+
+    glBindAttribLocation(resolveprog, 0, "a_vertex");
+    glBindFragDataLocation(resolveprog, 0, "fragColor");
+    glBindFragDataLocation(resolveprog, 1, "fragNoise");
+    glLinkProgram(resolveprog);
+    glError();
+
+    static const GLint units[4] = { 6, 7, 8, 9 };
+
+    glUseProgram(resolveprog);
+    glUniform1iv(glGetUniformLocation(resolveprog, "sums"), 2, units);
+    glUniform1iv(glGetUniformLocation(resolveprog, "moments"), 2, units + 2);
+    glUniform1i(glGetUniformLocation(resolveprog, "views"), views);
+    glUniform4f(glGetUniformLocation(resolveprog, "tile"), 1.f, 1.f, 0.f, 0.f);
+
+    if(denoiseIterations > 0)
+    {
+        updateSource(denoisefrag, "denoise.frag");
+
+        glBindAttribLocation(denoiseprog, 0, "a_vertex");
+        glBindFragDataLocation(denoiseprog, 0, "fragColor");
+        glLinkProgram(denoiseprog);
+        glError();
+
+        glUseProgram(denoiseprog);
+        glUniform1i(glGetUniformLocation(denoiseprog, "source"),  13);
+        glUniform1i(glGetUniformLocation(denoiseprog, "albedos"), 11);
+        glUniform1i(glGetUniformLocation(denoiseprog, "normals"), 12);
+        glUniform1i(glGetUniformLocation(denoiseprog, "views"), views);
+        glUniform4f(glGetUniformLocation(denoiseprog, "tile"), 1.f, 1.f, 0.f, 0.f);
+    }
+
+    if(guideResolution > 0)
+    {
+        updateSource(guidecomp, "guide.comp");
+
+        glLinkProgram(guideprog);
+        glError();
+
+        glUseProgram(guideprog);
+        glUniform1i(glGetUniformLocation(guideprog, "cells"), GUIDE_SLOTS);
+    }
+
+    if(cacheResolution > 0)
+    {
+        updateSource(cachecomp, "cache.comp");
+
+        glLinkProgram(cacheprog);
+        glError();
+
+        glUseProgram(cacheprog);
+        glUniform1i(glGetUniformLocation(cacheprog, "cells"), CACHE_SLOTS);
+    }
+
+    if(primaryVariants > 0) // fetches the scene, thus specialized as well
+    {
+        compileSource(primaryvert, readSource("primary.vert"), variant.prelude);
+        compileSource(primaryfrag, readSource("primary.frag"), variant.prelude);
+
+        glBindFragDataLocation(primaryprog, 0, "fragHit");
+        glLinkProgram(primaryprog);
+        glError();
+
+        glUseProgram(primaryprog);
+        glUniform1i(glGetUniformLocation(primaryprog, "vertices"), 1);
+        glUniform1i(glGetUniformLocation(primaryprog, "indices"),  2);
+    }
+
+    if(reprojectHistory > 0) // intersects the scene, thus specialized as well
+    {
+        compileSource(reprojectfrag, readSource("reproject.frag"), variant.prelude);
+
+        glBindAttribLocation(reprojectprog, 0, "a_vertex");
+        glBindFragDataLocation(reprojectprog, 0, "fragColor");
+        glBindFragDataLocation(reprojectprog, 1, "fragMoment");
+        glLinkProgram(reprojectprog);
+        glError();
+
+        glUseProgram(reprojectprog);
+        glUniform1i(glGetUniformLocation(reprojectprog, "normals"),  12);
+        glUniform1i(glGetUniformLocation(reprojectprog, "albedos"),  11);
+        glUniform1i(glGetUniformLocation(reprojectprog, "vertices"), 1);
+        glUniform1i(glGetUniformLocation(reprojectprog, "indices"),  2);
+        glUniform1i(glGetUniformLocation(reprojectprog, "materials"), 3);
+        glUniform1i(glGetUniformLocation(reprojectprog, "views"), views);
+    }
+
+    if(traceprog != -1)
+        glUseProgram(traceprog);
     glError();
 
-    viewport[0] = w;
-    viewport[1] = h;
+    if(wavefront)
+        updateWavefront(variant.prelude);
+
+    // trace program
+
+    std::map<std::string, GLuint>::const_iterator v(variants.find(variant.key));
+    GLuint program(variants.end() != v ? v->second : loadBinary(variant.key));
+
+    if(!program && compileContext && traceprog != -1)
+    {
+        compilation = variant;
+        compiled.store(false);
+        compiler = std::thread(compileInBackground);
+        return;
+    }
+
+    if(!program)
+        program = build(variant);
+    if(!program)
+        return;
+
+    variants[variant.key] = program;
+    adopt(program);
+}
+
+// adopts the program of a finished background compilation once its fence
+// signaled, and keeps rendering with the current program until then
+void poll()
+{
+    if(!compiler.joinable() || !compiled.load(std::memory_order_acquire))
+        return;
+
+    if(compilation.fence)
+    {
+        if(GL_TIMEOUT_EXPIRED == glClientWaitSync(compilation.fence, 0, 0))
+            return;
+        glDeleteSync(compilation.fence);
+        compilation.fence = 0;
+    }
+    compiler.join();
+
+    if(compilation.program)
+    {
+        variants[compilation.key] = compilation.program;
+        adopt(compilation.program);
+    }
+
+    if(reloadPending)
+    {
+        reloadPending = false;
+        update();
+    }
+}
+
+// samples per pixel accumulated so far
+int sampleCount()
+{
+    return (frame + 1) * samplesPerPass;
+}
+
+// returns the radical inverse of the index in the given base
+float halton(
+    int index
+,   const int base)
+{
+    float result(0.f);
+    for(float f = 1.f / base; index > 0; index /= base, f /= base)
+        result += f * (index % base);
+    return result;
+}
+
+// rasterizes the first hits of all views and jitter variants into the 
+// g-buffer, the depth test resolving visibility
+void rasterize()
+{
+    glUseProgram(primaryprog);
+    glUniform4fv(glGetUniformLocation(primaryprog, "tile"), 1, glm::value_ptr(region));
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, primarybuffer);
+    glBindVertexArray(primaryarray);
+
+    glEnable(GL_DEPTH_TEST);
+    glDepthMask(GL_TRUE);
+
+    for(int i = 0; i < views; ++i)
+    {
+        // ray basis of ndc (x, y, 1), see trace.geom, and one unit of depth
+        const glm::mat3 basis(glm::mat4(transforms[i][0], transforms[i][1], transforms[i][3], glm::vec4(0.f)));
+
+        glUniformMatrix3fv(glGetUniformLocation(primaryprog, "projection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(basis)));
+        glUniform3fv(glGetUniformLocation(primaryprog, "eye"), 1, glm::value_ptr(eyes[i]));
+        glUniform1f(glGetUniformLocation(primaryprog, "near"), 1.f / glm::length(basis[2]));
+
+        for(int j = 0; j < primaryVariants; ++j)
+        {
+            // halton (2, 3) points in the pixel, its center for a single variant
+            const glm::vec2 jitter(primaryVariants > 1 ? glm::vec2(halton(j + 1, 2), halton(j + 1, 3)) - 0.5f : glm::vec2(0.f));
+            glUniform2f(glGetUniformLocation(primaryprog, "jitter"), jitter.x * 2.f / resolution[0], jitter.y * 2.f / resolution[1]);
+
+            glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, hits, 0, i * primaryVariants + j);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glDrawArrays(GL_TRIANGLES, 0, triangles * 3);
+        }
+    }
+
+    glDepthMask(GL_FALSE);
+    glDisable(GL_DEPTH_TEST);
+
+    glBindVertexArray(vertexarray);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+
+    glUseProgram(traceprog);
+    glError();
+
+    rasterized = true;
+}
+
+// snapshots the guide trained so far as the one sampled by the next passes,
+// after 1, 2, 4, ... passes and every 64 beyond
+void learn()
+{
+    ++guidePasses;
+    if((guidePasses & (guidePasses - 1)) && guidePasses % 64)
+        return;
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(guideprog);
+    glDispatchCompute((GUIDE_SLOTS + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(traceprog);
+    glError();
+}
+
+// snapshots the radiance cached so far as the one the next pass ends its 
+// paths in, and fades out older samples (see cache.comp)
+void gather()
+{
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(cacheprog);
+    glDispatchCompute((CACHE_SLOTS + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(traceprog);
+    glError();
+}
+
+// increments frame number and binds the sums of the latest pass as source
+// of the next one
+void advance()
+{
+    if(primaryVariants > 0 && !rasterized)
+        rasterize();
+
+    if(guideResolution > 0)
+        learn();
+    if(cacheResolution > 0)
+        gather();
+
+    glUniform1i(u_frame, ++frame);
+    glUniform1i(u_accumulation, accumulation);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, sums[front]);
+
+    if(u_moments != -1) // bound to units 8 and 9 for good
+        glUniform1i(u_moments, 8 + front);
+
+    if(u_reservoirs != -1) // bound to units 15 to 18 for good
+    {
+        glUniform1i(u_reservoirs, 15 + front);
+        glUniform1i(u_reservoirCounts, 17 + front);
+    }
+}
+
+// makes the target of the completed pass the front (source of the next)
+void swap()
+{
+    front = 1 - front;
+}
+
+// applies the changed camera, carrying the accumulation over: the sums of the
+// front target are reprojected into the back target (see reproject.frag), 
+// which becomes the front, and the other target is cleared. Pixels keep at 
+// most the given history, those failing reprojection start from scratch, as
+// do tiles of a pass in progress.
+void reproject()
+{
+    std::vector<glm::mat3> reprojections(views); // inverse ray basis, see trace.geom
+    const std::vector<glm::vec3> previousEyes(eyes);
+
+    for(int i = 0; i < views; ++i)
+        reprojections[i] = glm::inverse(glm::mat3(glm::mat4(transforms[i][0], transforms[i][1], transforms[i][3], glm::vec4(0.f))));
+
+    look();
+
+    glUseProgram(reprojectprog);
+    glUniformMatrix4fv(glGetUniformLocation(reprojectprog, "transforms"), views, GL_FALSE, glm::value_ptr(transforms[0]));
+    glUniform3fv(glGetUniformLocation(reprojectprog, "eyes"), views, glm::value_ptr(eyes[0]));
+    glUniform4fv(glGetUniformLocation(reprojectprog, "tile"), 1, glm::value_ptr(region));
+    glUniformMatrix3fv(glGetUniformLocation(reprojectprog, "reprojections"), views, GL_FALSE, glm::value_ptr(reprojections[0]));
+    glUniform3fv(glGetUniformLocation(reprojectprog, "previousEyes"), views, glm::value_ptr(previousEyes[0]));
+    glUniform4f(glGetUniformLocation(reprojectprog, "viewport"), static_cast<float>(resolution[0]), static_cast<float>(resolution[1]), 0.f, 0.f);
+    glUniform1f(glGetUniformLocation(reprojectprog, "history"), static_cast<float>(reprojectHistory));
+    glUniform1i(glGetUniformLocation(reprojectprog, "source"), 6 + front);
+    glUniform1i(glGetUniformLocation(reprojectprog, "moments"), 8 + front);
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, reprojectbuffer);
+    glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, sums[1 - front], 0);
+    if(noiseThreshold > 0.f)
+        glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, moments[1 - front], 0);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    swap();
+
+    if(restirCandidates > 0) // reservoirs of the front target were resampled for the previous view
+    {
+        const GLfloat zeros[4] = { 0.f, 0.f, 0.f, 0.f };
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[front]);
+        glClearBufferfv(GL_COLOR, 4, zeros);
+        glClearBufferfv(GL_COLOR, 5, zeros);
+    }
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[1 - front]); // the previous view, features included
+    glClear(GL_COLOR_BUFFER_BIT);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+
+    glUseProgram(traceprog);
+    glError();
+
+    restart();
+}
+
+// (re)allocates path states and queues for all paths of a pass at viewport size
+void allocateWavefront()
+{
+    const GLint capacity(viewport[0] * viewport[1] * views * samplesPerPass);
+    if(capacity == wavefrontCapacity)
+        return;
+    wavefrontCapacity = capacity;
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontPaths);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * 20 * sizeof(GLfloat), nullptr, GL_DYNAMIC_COPY); // Path
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontQueues);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * 3 * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontShadows);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * (environmentPath ? 2 : 1) * 12 * sizeof(GLfloat), nullptr, GL_DYNAMIC_COPY); // Shadow, one per light source
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontCounters);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (4 + 4 * 4) * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, wavefrontPaths);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, wavefrontQueues);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, wavefrontShadows);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, wavefrontCounters);
+    glError();
+}
+
+// computes the indirect dispatch arguments of a queue (-1 for none) and 
+// resets the counts of the queues given as bit mask
+void arguments(
+    const int queue
+,   const GLuint resets)
+{
+    const GLuint program(wavefrontprogs[Arguments]);
+
+    glUseProgram(program);
+    glUniform1i (glGetUniformLocation(program, "queue"),  queue);
+    glUniform1ui(glGetUniformLocation(program, "resets"), resets);
+    glDispatchCompute(1, 1, 1);
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+}
+
+// runs a stage over the entries of a queue, dispatched indirectly
+void process(
+    const WavefrontStage stage
+,   const int queue
+,   const int current)
+{
+    const GLuint program(wavefrontprogs[stage]);
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "current"), current);
+    glDispatchComputeIndirect(static_cast<GLintptr>((4 + queue * 4) * sizeof(GLuint)));
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+// traces a pass with the wavefront stages, adding to the sums of the front
+// target into the back target - one path per pixel, view, and sample
+void traceWavefront()
+{
+    const GLint capacity(resolution[0] * resolution[1] * views * samplesPerPass);
+    const glm::vec2 viewportf(resolution[0], resolution[1]);
+
+    for(int i = 0; i < WAVEFRONT_STAGES; ++i)
+    {
+        glUseProgram(wavefrontprogs[i]);
+        glUniform1i(glGetUniformLocation(wavefrontprogs[i], "capacity"), capacity);
+        glUniform4f(glGetUniformLocation(wavefrontprogs[i], "viewport"), viewportf.x, viewportf.y, 1.f / viewportf.x, 1.f / viewportf.y);
+    }
+
+    glUseProgram(wavefrontprogs[Shade]);
+    glUniform1i(glGetUniformLocation(wavefrontprogs[Shade], "accumulation"), accumulation);
+
+    const GLuint generate(wavefrontprogs[Generate]);
+
+    glUseProgram(generate);
+    glUniform1i(glGetUniformLocation(generate, "frame"), frame);
+    glUniform1i(glGetUniformLocation(generate, "current"), 0);
+    glUniform4fv(glGetUniformLocation(generate, "tile"), 1, glm::value_ptr(region));
+    glUniformMatrix4fv(glGetUniformLocation(generate, "transforms"), views, GL_FALSE, glm::value_ptr(transforms[0]));
+    glUniform3fv(glGetUniformLocation(generate, "eyes"), views, glm::value_ptr(eyes[0]));
+
+    arguments(-1, 0xf);
+
+    glUseProgram(generate);
+    glDispatchCompute((capacity + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, wavefrontCounters);
+
+    if(featureBuffers)
+    {
+        glBindImageTexture(1, albedos, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindImageTexture(2, normals, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    }
+
+    int current(0);
+    for(int bounce = 0; bounce < bounces; ++bounce)
+    {
+        arguments(Extensions + current, 1 << Hits);
+        process(Extend, Extensions + current, current);
+
+        arguments(Hits, 1 << Shadows | 1 << (Extensions + 1 - current));
+        process(Shade, Hits, current);
+
+        arguments(Shadows, 0);
+        process(Connect, Shadows, current);
+
+        current = 1 - current;
+    }
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+
+    glUseProgram(wavefrontprogs[Accumulate]);
+    glBindImageTexture(0, sums[1 - front], 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glDispatchCompute((capacity / samplesPerPass + 63) / 64, 1, 1);
+
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+
+    glUseProgram(traceprog);
+    glError();
+}
+
+// averages the sums into the resolved texture, for display and readback
+void resolve()
+{
+    shown = texture;
+
+    glUseProgram(resolveprog);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glUseProgram(traceprog);
+    glError();
+}
+
+// filters the resolved texture guided by the feature textures, iterations
+// with growing steps alternating between the filtered textures. Workers 
+// spool raw sums, the coordinator filters.
+void denoise()
+{
+    if(denoiseIterations <= 0 || spool)
+        return;
+
+    glUseProgram(denoiseprog);
+    glUniform4f(glGetUniformLocation(denoiseprog, "viewport"), static_cast<float>(resolution[0]), static_cast<float>(resolution[1]), 0.f, 0.f);
+
+    glActiveTexture(GL_TEXTURE13);
+    for(int i = 0; i < denoiseIterations; ++i)
+    {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0 == i ? texture : filtered[(i - 1) % 2]);
+
+        glUniform1i(glGetUniformLocation(denoiseprog, "iteration"), i);
+        glUniform1i(glGetUniformLocation(denoiseprog, "last"), denoiseIterations - 1 == i);
+
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, filterbuffers[i % 2]);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glUseProgram(traceprog);
+    glError();
+
+    shown = filtered[(denoiseIterations - 1) % 2];
+}
+
+// splits the traced resolution into dispatch tiles, ordered by distance to its center
+void tessellate()
+{
+    dispatchTiles.clear();
+    dispatchOrder.clear();
+
+    for(GLint y = 0; y < resolution[1]; y += budgetTile)
+        for(GLint x = 0; x < resolution[0]; x += budgetTile)
+        {
+            DispatchTile t = { x, y, std::min(budgetTile, resolution[0] - x), std::min(budgetTile, resolution[1] - y), budget * 0.25f, false };
+
+            dispatchOrder.push_back(dispatchTiles.size());
+            dispatchTiles.push_back(t);
+        }
+
+    const glm::vec2 middle(resolution[0] * 0.5f, resolution[1] * 0.5f);
+    std::stable_sort(dispatchOrder.begin(), dispatchOrder.end(), [&](const size_t a, const size_t b)
+    {
+        const DispatchTile & ta(dispatchTiles[a]);
+        const DispatchTile & tb(dispatchTiles[b]);
+        return glm::length(glm::vec2(ta.x + ta.w * 0.5f, ta.y + ta.h * 0.5f) - middle)
+             < glm::length(glm::vec2(tb.x + tb.w * 0.5f, tb.y + tb.h * 0.5f) - middle);
+    });
+
+    dispatchNext = 0;
+}
+
+// updates tile costs from all timer queries with results available
+void measure()
+{
+    while(!pendingQueries.empty())
+    {
+        const GLuint query(pendingQueries.front().first);
+
+        GLint available(GL_FALSE);
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if(GL_FALSE == available)
+            break;
+
+        GLuint64 elapsed(0); // nanoseconds
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+
+        const size_t index(pendingQueries.front().second);
+        if(index < dispatchTiles.size()) // tiles might have changed meanwhile
+            dispatchTiles[index].cost = glm::mix(dispatchTiles[index].cost, static_cast<float>(elapsed) * 1e-6f, 0.5f);
+
+        queries.push_back(query);
+        pendingQueries.pop_front();
+    }
+}
+
+// starts the next pass if none is in progress, and traces tiles of the pass
+// until the estimated cost exceeds the budget (at least one tile per call, 
+// all without budget). Converged tiles are skipped. Returns true if the pass 
+// was completed.
+const bool dispatch()
+{
+    measure();
+
+    if(0 == dispatchNext)
+        advance();
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[1 - front]);
+    glEnable(GL_SCISSOR_TEST);
+
+    float spent(0.f);
+    while(dispatchNext < dispatchOrder.size())
+    {
+        const size_t index(dispatchOrder[dispatchNext]);
+        const DispatchTile & t(dispatchTiles[index]);
+
+        if(t.converged)
+        {
+            ++dispatchNext;
+            continue;
+        }
+        if(budget > 0.f && spent > 0.f && spent + t.cost > budget)
+            break;
+
+        glScissor(t.x, t.y, t.w, t.h);
+        tracedPaths += static_cast<long long>(t.w) * t.h * views * samplesPerPass;
+
+        if(budget <= 0.f)
+        {
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            ++dispatchNext;
+            continue;
+        }
+
+        if(queries.empty())
+        {
+            queries.push_back(0);
+            glGenQueries(1, &queries.back());
+        }
+        const GLuint query(queries.back());
+        queries.pop_back();
+
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glEndQuery(GL_TIME_ELAPSED);
+        glFlush(); // submit per tile, keeps single command buffers short
+
+        pendingQueries.push_back(std::make_pair(query, index));
+
+        spent += t.cost;
+        ++dispatchNext;
+    }
+
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glError();
+
+    if(dispatchNext < dispatchOrder.size())
+        return false;
+
+    dispatchNext = 0;
+    swap();
+    return true;
+}
+
+// returns true if adaptive sampling found all tiles converged
+const bool converged()
+{
+    if(noiseThreshold <= 0.f || dispatchTiles.empty())
+        return false;
+
+    for(size_t i = 0; i < dispatchTiles.size(); ++i)
+        if(!dispatchTiles[i].converged)
+            return false;
+    return true;
+}
+
+// collects the pending noise estimate if the gpu is done with it and marks 
+// tiles as converged whose rms noise (over all views) meets the threshold - 
+// single pixel estimates are too noisy themselves. Issues the next readback
+// every few completed passes, never blocks.
+void estimate()
+{
+    if(noiseThreshold <= 0.f)
+        return;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, noisePBO);
+
+    if(noiseFence)
+    {
+        if(GL_TIMEOUT_EXPIRED == glClientWaitSync(noiseFence, 0, 0))
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            return;
+        }
+        glDeleteSync(noiseFence);
+        noiseFence = 0;
+
+        const float * pixels(static_cast<const float *>(glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY)));
+        const GLint w(noisePending[0]);
+        const GLint h(noisePending[1]);
+
+        for(size_t i = 0; pixels && i < dispatchTiles.size(); ++i)
+        {
+            DispatchTile & t(dispatchTiles[i]);
+            if(t.converged || t.x + t.w > w || t.y + t.h > h)
+                continue;
+
+            double squares(0.0);
+            for(int view = 0; view < views; ++view)
+                for(GLint y = t.y; y < t.y + t.h; ++y)
+                    for(GLint x = t.x; x < t.x + t.w; ++x)
+                        squares += pixels[(view * h + y) * w + x] * pixels[(view * h + y) * w + x];
+
+            t.converged = sqrt(squares / (t.w * t.h * views)) < noiseThreshold;
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+
+    if(sampleCount() >= noiseMinSamples && frame - noiseFrame >= noiseInterval && !converged())
+    {
+        noiseFrame = frame;
+
+        if(noisePending[0] != resolution[0] || noisePending[1] != resolution[1])
+            glBufferData(GL_PIXEL_PACK_BUFFER, resolution[0] * resolution[1] * views * sizeof(GLfloat), nullptr, GL_STREAM_READ);
+
+        noisePending[0] = resolution[0];
+        noisePending[1] = resolution[1];
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, layerbuffer);
+        for(int view = 0; view < views; ++view)
+        {
+            glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, noise, 0, view);
+            glReadPixels(0, 0, resolution[0], resolution[1], GL_RED, GL_FLOAT
+                , reinterpret_cast<GLvoid *>(view * resolution[0] * resolution[1] * sizeof(GLfloat)));
+        }
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+        noiseFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glError();
+}
+
+// traces only the given fraction of the viewport from now on, restarting 
+// the accumulation - the accumulation texture keeps its size
+void rescale(const float scale)
+{
+    resolutionScale = scale;
+
+    resolution[0] = std::max(1, static_cast<GLint>(viewport[0] * scale + 0.5f));
+    resolution[1] = std::max(1, static_cast<GLint>(viewport[1] * scale + 0.5f));
+
+    const glm::vec2 viewportf(resolution[0], resolution[1]);
+
+    glViewport(0, 0, resolution[0], resolution[1]);
+    glUniform4f(u_viewport, viewportf.x, viewportf.y, 1.f / viewportf.x, 1.f / viewportf.y);
+    glError();
+
+    tessellate();
+    clear();
+}
+
+// measures the frame time and adjusts the resolution scale, assuming costs 
+// proportional to the number of pixels: moving cameras meet the target, 
+// static views are native unless their estimated frame time exceeds it.
+// Small changes are ignored, since every change restarts the accumulation.
+void adapt()
+{
+    const int now(glutGet(GLUT_ELAPSED_TIME));
+    const float elapsed(static_cast<float>(now - lastDisplay));
+    lastDisplay = now;
+
+    if(targetFrameTime <= 0.f || spool || !jobs.empty() || poster[0]) // written images are native
+        return;
+
+    frameTime = frameTime > 0.f ? glm::mix(frameTime, elapsed, 0.25f) : elapsed;
+
+    const bool moving(lastMove >= 0 && now - lastMove < settleTime);
+    if(!moving)
+        lastMove = -1;
+
+    const float native(frameTime / (resolutionScale * resolutionScale)); // estimated
+
+    float scale(1.f);
+    if(frameTime > 0.f && (moving || native > targetFrameTime))
+        scale = glm::clamp(resolutionScale * sqrtf(targetFrameTime / frameTime), minScale, 1.f);
+
+    if(fabsf(scale - resolutionScale) > 0.1f * resolutionScale || (1.f == scale && 1.f != resolutionScale))
+    {
+        rescale(scale);
+        frameTime = 0.f; // new resolution, new measurement
+    }
+}
+
+// resizes viewport and accumulation texture, configures the camera/view
+void on_reshape(int w, int h)
+{
+    glError();
+
+    if(poster[0]) // the accumulation target holds a single tile
+        w = h = posterTile;
+
+    viewport[0] = w;
+    viewport[1] = h;
+
+    // resize fbo textures (one layer per view)
+
+    const GLuint textures[3] = { sums[0], sums[1], texture };
+    for(int i = 0; i < 3; ++i)
+    {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textures[i]);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, halfFloat && texture == textures[i] ? GL_RGBA16F : GL_RGBA32F
+            , viewport[0], viewport[1], views, 0, GL_RGBA, GL_FLOAT, 0);
+	    glError();
+
+        glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);  
+	    glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);  
+	    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+	    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST); 
+    }
+    glError();
+
+    if(noiseThreshold > 0.f)
+    {
+        const GLuint estimates[3] = { moments[0], moments[1], noise };
+        for(int i = 0; i < 3; ++i)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, estimates[i]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, viewport[0], viewport[1], views, 0, GL_RED, GL_FLOAT, 0);
+        }
+        glError();
+    }
+
+    if(featureBuffers)
+    {
+        const GLenum format(halfFloat ? GL_RGBA16F : GL_RGBA32F); // as the resolved texture
+
+        const GLuint denoising[4] = { albedos, normals, filtered[0], filtered[1] };
+        const GLenum formats[4] = { GL_RGBA16F, GL_RGBA32F, format, format };
+        for(int i = 0; i < (denoiseIterations > 0 ? 4 : 2); ++i)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, denoising[i]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, formats[i], viewport[0], viewport[1], views, 0, GL_RGBA, GL_FLOAT, 0);
+        }
+        glError();
+    }
+
+    if(restirCandidates > 0)
+    {
+        const GLuint resampling[4] = { reservoirs[0], reservoirs[1], reservoirCounts[0], reservoirCounts[1] };
+        for(int i = 0; i < 4; ++i)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, resampling[i]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA32F, viewport[0], viewport[1], views, 0, GL_RGBA, GL_FLOAT, 0);
+        }
+        glError();
+    }
+
+    if(primaryVariants > 0)
+    {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, hits);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA32F, viewport[0], viewport[1], views * primaryVariants, 0, GL_RGBA, GL_FLOAT, 0);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, hitDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, viewport[0], viewport[1]);
+        glError();
+    }
+
+    if(wavefront)
+        allocateWavefront();
+
+    rescale(1.f);
+}
+
+// binds a single layer of the resolved (or denoised) texture for reading
+void bindLayer(const GLint layer)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, layerbuffer);
+    glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, shown, 0, layer);
+}
+
+// reads back one layer (view) of the shown texture as RGBA32F, at the
+// traced resolution
+void readback(
+    const GLint layer
+,   float * pixels)
+{
+    bindLayer(layer);
+    glReadPixels(0, 0, resolution[0], resolution[1], GL_RGBA, GL_FLOAT, pixels);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glError();
+}
+
+// releases the shared framebuffer, marking it stale for attached viewers
+void unpublish()
+{
+#ifndef WIN32
+    if(!shm)
+        return;
+
+    shm->stale.store(1);
+    munmap(shm, sharedSize(shm->capacity));
+    shm_unlink(shmName);
+
+    shm = nullptr;
+#endif
+}
+
+// copies an RGBA32F image into the back buffer of the shared framebuffer
+// and flips it to front. The segment is recreated if it is too small.
+void publish(
+    const float * pixels
+,   const GLint width
+,   const GLint height
+,   const int samples)
+{
+#ifndef WIN32
+    const std::uint32_t size(static_cast<std::uint32_t>(width * height));
+
+    if(shm && shm->capacity < size)
+        unpublish();
+    if(!shm)
+        shm = createShared(shmName, size);
+    if(!shm)
+    {
+        std::cerr << "Shared memory \"" << shmName << "\" unavailable." << std::endl;
+        shmName = nullptr;
+        return;
+    }
+
+    const std::uint32_t back(1 - shm->front.load(std::memory_order_relaxed));
+    SharedBuffer & buffer(shm->buffers[back]);
+
+    const std::uint32_t sequence(buffer.sequence.load(std::memory_order_relaxed));
+    buffer.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    std::memcpy(sharedPixels(shm, back), pixels, size * 4 * sizeof(float));
+    buffer.width  = width;
+    buffer.height = height;
+    buffer.frame  = samples - 1;
+
+    buffer.sequence.store(sequence + 2, std::memory_order_release);
+    shm->front.store(back, std::memory_order_release);
+#endif
+}
+
+// collects the pending readback if the gpu is done with it, and issues the 
+// next one if the publish interval passed. Never blocks on gpu or viewers.
+void share()
+{
+    if(!shmName)
+        return;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, shmPBO);
+
+    if(shmFence)
+    {
+        if(GL_TIMEOUT_EXPIRED == glClientWaitSync(shmFence, 0, 0))
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            return;
+        }
+        glDeleteSync(shmFence);
+        shmFence = 0;
+
+        const float * pixels(static_cast<const float *>(glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY)));
+        if(pixels)
+            publish(pixels, shmPending[0], shmPending[1], shmPending[2]);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+
+    const int now(glutGet(GLUT_ELAPSED_TIME));
+    if(now - shmLast >= shmInterval)
+    {
+        shmLast = now;
+
+        if(shmPending[0] != resolution[0] || shmPending[1] != resolution[1])
+            glBufferData(GL_PIXEL_PACK_BUFFER, resolution[0] * resolution[1] * 4 * sizeof(GLfloat), nullptr, GL_STREAM_READ);
+
+        shmPending[0] = resolution[0];
+        shmPending[1] = resolution[1];
+        shmPending[2] = sampleCount();
+
+        readback(0, nullptr); // first view only
+
+        shmFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glError();
+}
+
+// writes rgb of an RGBA32F image as portable float map - rows are stored 
+// bottom-to-top in pfm as well, so read backs need no flipping
+bool writePFM(
+    const char * filepath
+,   const GLint width
+,   const GLint height
+,   const float * rgba)
+{
+    std::ofstream stream(filepath, std::ios::out | std::ios::binary);
+    if(!stream)
+    {
+        std::cerr << "Write to \"" << filepath << "\" failed." << std::endl;
+        return false;
+    }
+    stream << "PF\n" << width << " " << height << "\n-1.0\n";
+
+    std::vector<float> rgb(width * 3);
+    for(GLint y = 0; y < height; ++y)
+    {
+        for(GLint x = 0; x < width; ++x)
+            std::copy(rgba + (y * width + x) * 4, rgba + (y * width + x) * 4 + 3, &rgb[x * 3]);
+        stream.write(reinterpret_cast<const char *>(&rgb[0]), rgb.size() * sizeof(float));
+    }
+    return true;
+}
+
+// reads a pfm image (color or grayscale, either byte order) into rgb pixels,
+// rows from the bottom as stored
+bool readPFM(
+    const char * filepath
+,   GLint & width
+,   GLint & height
+,   std::vector<float> & rgb)
+{
+    std::ifstream stream(filepath, std::ios::in | std::ios::binary);
+
+    std::string magic;
+    float scale(0.f);
+    stream >> magic >> width >> height >> scale;
+    stream.get(); // single whitespace before the pixels
+
+    const int channels("PF" == magic ? 3 : 1);
+    std::vector<float> pixels;
+
+    if(stream && ("PF" == magic || "Pf" == magic) && width > 0 && height > 0)
+    {
+        pixels.resize(width * height * channels);
+        stream.read(reinterpret_cast<char *>(&pixels[0]), pixels.size() * sizeof(float));
+    }
+    if(!stream || pixels.empty())
+    {
+        std::cerr << "Read from \"" << filepath << "\" failed." << std::endl;
+        return false;
+    }
+
+    if(scale > 0.f) // big endian
+        for(size_t i = 0; i < pixels.size(); ++i)
+        {
+            char * bytes(reinterpret_cast<char *>(&pixels[i]));
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+        }
+
+    rgb.resize(width * height * 3);
+    for(size_t i = 0; i < rgb.size(); ++i)
+        rgb[i] = pixels[3 == channels ? i : i / 3];
+
+    return true;
+}
+
+// spool file: header followed by RGBA32F sum-and-count pixels
+struct SpoolHeader
+{
+    char magic[8];
+    GLint width;
+    GLint height;
+};
+
+static const char spoolMagic[8] = "pathglS";
+
+const std::string spoolPath(const std::string & name)
+{
+    return std::string(spool) + "/" + name;
+}
+
+const bool spoolDone()
+{
+    return std::ifstream(spoolPath("done").c_str()).good();
+}
+
+// writes header and pixels into the spool, to .part and renamed so the 
+// coordinator never sees partial files
+void spoolFile(
+    const std::string & name
+,   const std::vector<float> & pixels)
+{
+    SpoolHeader header;
+    std::memcpy(header.magic, spoolMagic, sizeof(spoolMagic));
+    header.width  = viewport[0];
+    header.height = viewport[1];
+
+    const std::string part(spoolPath(name + ".part"));
+    {
+        std::ofstream stream(part.c_str(), std::ios::out | std::ios::binary);
+        stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        stream.write(reinterpret_cast<const char *>(&pixels[0]), pixels.size() * sizeof(float));
+    }
+    if(0 != rename(part.c_str(), spoolPath(name).c_str()))
+        std::cerr << "Spooling \"" << part << "\" failed." << std::endl;
+}
+
+// worker: spools albedo (RGBA) followed by normal and depth (RGBA) of the 
+// first hits, for the coordinator to denoise with - the camera is the same
+// for all batches, so once per worker
+void spoolFeatures()
+{
+    const GLint size(viewport[0] * viewport[1]);
+    std::vector<float> features(size * 8);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, layerbuffer);
+    glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, albedos, 0, 0);
+    glReadPixels(0, 0, viewport[0], viewport[1], GL_RGBA, GL_FLOAT, &features[0]);
+    glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, normals, 0, 0);
+    glReadPixels(0, 0, viewport[0], viewport[1], GL_RGBA, GL_FLOAT, &features[size * 4]);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glError();
+
+    std::ostringstream name;
+    name << seed << ".features";
+
+    spoolFile(name.str(), features);
+}
+
+// worker: reads back the current batch, converts the running average into 
+// sum-and-count and moves it into the spool. Starts the next batch.
+void spoolBatch()
+{
+    const GLint size(viewport[0] * viewport[1]);
+    std::vector<float> pixels(size * 4);
+
+    readback(0, &pixels[0]); // first view only
+
+    const float samples(static_cast<float>(sampleCount()));
+    for(GLint i = 0; i < size; ++i)
+    {
+        pixels[i * 4 + 0] *= samples;
+        pixels[i * 4 + 1] *= samples;
+        pixels[i * 4 + 2] *= samples;
+        pixels[i * 4 + 3]  = samples;
+    }
+
+    if(denoiseIterations > 0 && 0 == batch)
+        spoolFeatures();
+
+    std::ostringstream name;
+    name << seed << "-" << batch++ << ".sum";
+
+    spoolFile(name.str(), pixels);
+
+    if(spoolDone())
+        exit(0);
+
+    clear();
+}
+
+// edge-avoiding a-trous wavelet filter of an RGBA image on the cpu, with the
+// kernel and weights of denoise.frag: guided by albedo (rgb) and normal and
+// depth (xyzw) of the first hits, lighting only. Rows are split among all
+// hardware threads, joined after each iteration.
+void atrous(
+    std::vector<float> & image
+,   const float * albedo
+,   const float * normal
+,   const GLint width
+,   const GLint height
+,   const int iterations)
+{
+    static const float kernel[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+    static const float sigmaColor(0.5f); // as in denoise.frag
+    static const float sigmaDepth(0.01f);
+    static const float normalExponent(64.f);
+
+    std::vector<float> source(image.size());
+    std::vector<float> target(image.size());
+
+    for(size_t i = 0; i < image.size(); ++i) // demodulate (albedo alpha holds the material)
+        source[i] = i % 4 < 3 ? image[i] / std::max(albedo[i], 0.01f) : image[i];
+
+    const int threads(std::max(1, static_cast<int>(std::thread::hardware_concurrency())));
+
+    for(int iteration = 0; iteration < iterations; ++iteration)
+    {
+        const int step(1 << iteration);
+        const float sigma(ldexpf(sigmaColor, -iteration));
+
+        auto filter = [&](const GLint begin, const GLint end)
+        {
+            for(GLint y = begin; y < end; ++y)
+                for(GLint x = 0; x < width; ++x)
+                {
+                    const size_t p((y * width + x) * 4);
+
+                    glm::vec3 sum(0.f);
+                    float weights(0.f);
+
+                    for(int j = -2; j <= 2; ++j)
+                        for(int i = -2; i <= 2; ++i)
+                        {
+                            const GLint qx(x + i * step);
+                            const GLint qy(y + j * step);
+                            if(qx < 0 || qy < 0 || qx >= width || qy >= height)
+                                continue;
+
+                            const size_t q((qy * width + qx) * 4);
+
+                            const glm::vec3 cq(source[q], source[q + 1], source[q + 2]);
+                            const glm::vec3 d(glm::vec3(source[p], source[p + 1], source[p + 2]) - cq);
+                            const float n(normal[p] * normal[q] + normal[p + 1] * normal[q + 1] + normal[p + 2] * normal[q + 2]);
+
+                            const float w(kernel[abs(i)] * kernel[abs(j)]
+                                * expf(-glm::dot(d, d) / (sigma * sigma))
+                                * powf(std::max(n, 0.f), normalExponent)
+                                * expf(-fabsf(normal[p + 3] - normal[q + 3]) 
+                                    / (sigmaDepth * normal[p + 3] * sqrtf(static_cast<float>(i * i + j * j)) * step + 1e-4f)));
+
+                            sum += cq * w;
+                            weights += w;
+                        }
+
+                    for(int c = 0; c < 3; ++c)
+                        target[p + c] = weights > 0.f ? sum[c] / weights : source[p + c];
+                    target[p + 3] = source[p + 3];
+                }
+        };
+
+        std::vector<std::thread> workers;
+        for(int t = 0; t < threads; ++t)
+            workers.push_back(std::thread(filter, height * t / threads, height * (t + 1) / threads));
+        for(std::thread & worker : workers)
+            worker.join();
+
+        source.swap(target);
+    }
+
+    for(size_t i = 0; i < image.size(); i += 4) // remodulate
+        for(int c = 0; c < 3; ++c)
+            image[i + c] = source[i + c] * std::max(albedo[i + c], 0.01f);
+}
+
+// coordinator (no gl required): merges all spooled batches into a double
+// precision sum-and-count buffer, publishes the average to shared memory if
+// requested, and finishes when every pixel reached the target sample count.
+// The average is denoised if requested and features were spooled.
+int coordinate()
+{
+#ifndef WIN32
+    std::vector<double> sum;
+    std::vector<float> features; // albedo, then normal and depth
+    GLint featureSize[2] = { 0, 0 };
+    GLint width(0);
+    GLint height(0);
+    double samples(0.0); // minimum over all pixels
+
+    remove(spoolPath("done").c_str());
+
+    while(0 == targetSamples || samples < targetSamples)
+    {
+        std::vector<std::string> names;
+
+        DIR * dir(opendir(spool));
+        if(!dir)
+        {
+            std::cerr << "Spool \"" << spool << "\" not accessible." << std::endl;
+            return 1;
+        }
+        while(const dirent * entry = readdir(dir))
+        {
+            const std::string name(entry->d_name);
+            if(name.size() > 4 && 0 == name.compare(name.size() - 4, 4, ".sum"))
+                names.push_back(name);
+            else if(name.size() > 9 && 0 == name.compare(name.size() - 9, 9, ".features"))
+            {
+                const std::string filepath(spoolPath(name));
+                std::ifstream stream(filepath.c_str(), std::ios::in | std::ios::binary);
+
+                SpoolHeader header;
+                stream.read(reinterpret_cast<char *>(&header), sizeof(header));
+
+                if(stream && 0 == std::memcmp(header.magic, spoolMagic, sizeof(spoolMagic)))
+                {
+                    features.resize(header.width * header.height * 8);
+                    stream.read(reinterpret_cast<char *>(&features[0]), features.size() * sizeof(float));
+                    featureSize[0] = header.width;
+                    featureSize[1] = header.height;
+                }
+                if(!stream)
+                    features.clear();
+                stream.close();
+
+                remove(filepath.c_str());
+            }
+        }
+        closedir(dir);
+
+        int merged(0);
+        for(const std::string & name : names)
+        {
+            const std::string filepath(spoolPath(name));
+            std::ifstream stream(filepath.c_str(), std::ios::in | std::ios::binary);
+
+            SpoolHeader header;
+            stream.read(reinterpret_cast<char *>(&header), sizeof(header));
+
+            const bool valid(stream && 0 == std::memcmp(header.magic, spoolMagic, sizeof(spoolMagic))
+                && (sum.empty() || (header.width == width && header.height == height)));
+
+            std::vector<float> pixels(valid ? header.width * header.height * 4 : 0);
+            if(valid)
+                stream.read(reinterpret_cast<char *>(&pixels[0]), pixels.size() * sizeof(float));
+            stream.close();
+
+            remove(filepath.c_str());
+
+            if(!valid || !stream)
+            {
+                std::cerr << "Spooled \"" << name << "\" invalid or mismatching, discarded." << std::endl;
+                continue;
+            }
+            if(sum.empty())
+            {
+                width  = header.width;
+                height = header.height;
+                sum.resize(pixels.size(), 0.0);
+            }
+            for(size_t i = 0; i < pixels.size(); ++i)
+                sum[i] += pixels[i];
+            ++merged;
+        }
+
+        if(0 == merged)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+
+        std::vector<float> average(sum.size());
+        samples = sum[3];
+        for(size_t i = 0; i < sum.size(); i += 4)
+        {
+            const double count(std::max(sum[i + 3], 1.0));
+            average[i + 0] = static_cast<float>(sum[i + 0] / count);
+            average[i + 1] = static_cast<float>(sum[i + 1] / count);
+            average[i + 2] = static_cast<float>(sum[i + 2] / count);
+            average[i + 3] = 1.f;
+            samples = std::min(samples, sum[i + 3]);
+        }
+        std::cout << "Merged " << merged << " batch(es), " << samples << " samples per pixel." << std::endl;
+
+        if(denoiseIterations > 0 && !features.empty() && featureSize[0] == width && featureSize[1] == height)
+            atrous(average, &features[0], &features[average.size()], width, height, denoiseIterations);
+
+        if(shmName)
+            publish(&average[0], width, height, static_cast<int>(samples));
+        if(output && (0 == targetSamples || samples >= targetSamples))
+            writePFM(output, width, height, &average[0]);
+    }
+
+    std::ofstream(spoolPath("done").c_str()) << samples << std::endl;
+    unpublish();
+
+    return 0;
+#else
+    std::cerr << "Coordinator unsupported on this platform." << std::endl;
+    return 1;
+#endif
+}
+
+// reads the job file, one camera keyframe per line (# for comments):
+//   eye.x eye.y eye.z center.x center.y center.z fovy samples output [frames]
+// output may contain a printf pattern for the job index (e.g., frame%04d.pfm).
+// A keyframe with frames > 1 is interpolated linearly towards the next one.
+bool loadJobs(const char * jobpath)
+{
+	std::ifstream stream(jobpath, std::ios::in);
+	if(!stream)
+	{
+        std::cerr << "Read from \"" << jobpath << "\" failed." << std::endl;
+        return false;
+    }
+
+    std::vector<Job> keys;
+    std::vector<int> frames;
+
+    std::string line;
+    for(int number = 1; std::getline(stream, line); ++number)
+    {
+        std::istringstream fields(line);
+
+        Job key;
+        int count(1);
+
+        fields >> std::ws;
+        if(fields.eof() || '#' == fields.peek())
+            continue;
+
+        fields >> key.eye.x >> key.eye.y >> key.eye.z >> key.center.x >> key.center.y >> key.center.z 
+            >> key.fovy >> key.samples >> key.output;
+        if(!fields || key.samples < 1)
+        {
+            std::cerr << "Job \"" << jobpath << "\" line " << number << " invalid." << std::endl;
+            return false;
+        }
+        fields >> count;
+
+        keys.push_back(key);
+        frames.push_back(std::max(1, count));
+    }
+
+    char filepath[1024];
+    for(size_t k = 0; k < keys.size(); ++k)
+    {
+        const Job & key(keys[k]);
+        const Job & next(keys[std::min(k + 1, keys.size() - 1)]);
+        const int count(k + 1 < keys.size() ? frames[k] : 1);
+
+        for(int f = 0; f < count; ++f)
+        {
+            const float t(static_cast<float>(f) / static_cast<float>(count));
+
+            Job interpolated(key);
+            interpolated.eye    = glm::mix(key.eye, next.eye, t);
+            interpolated.center = glm::mix(key.center, next.center, t);
+            interpolated.fovy   = glm::mix(key.fovy, next.fovy, t);
+
+            snprintf(filepath, sizeof(filepath), key.output.c_str(), static_cast<int>(jobs.size()));
+            interpolated.output = filepath;
+
+            jobs.push_back(interpolated);
+        }
+    }
+    return !jobs.empty();
+}
+
+void writeImages()
+{
+    std::unique_lock<std::mutex> lock(writerMutex);
+    while(true)
+    {
+        writerCondition.wait(lock, [] { return writerDone || !writerQueue.empty(); });
+        if(writerQueue.empty())
+            return;
+
+        Image image(std::move(writerQueue.front()));
+        writerQueue.pop_front();
+
+        lock.unlock();
+        writePFM(image.filepath.c_str(), image.width, image.height, &image.pixels[0]);
+        lock.lock();
+    }
+}
+
+// lets the writer finish all queued images, registered at exit since the
+// thread must not be joinable anymore when globals get destroyed
+void joinWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        writerDone = true;
+    }
+    writerCondition.notify_one();
+
+    if(writer.joinable())
+        writer.join();
+}
+
+// applies the camera of the current job, everything else stays as is
+void startJob()
+{
+    eye    = jobs[job].eye;
+    center = jobs[job].center;
+    fovy   = jobs[job].fovy;
+
+    jobStart = glutGet(GLUT_ELAPSED_TIME);
+    clear();
+}
+
+// output path of a view, for multiple views the index is appended to the name
+const std::string viewPath(
+    const std::string & filepath
+,   const int view)
+{
+    if(1 == views)
+        return filepath;
+
+    const size_t dot(filepath.find_last_of('.'));
+    const size_t slash(filepath.find_last_of("/\\"));
+    const size_t split(std::string::npos == dot || (std::string::npos != slash && dot < slash) ? filepath.size() : dot);
+
+    std::ostringstream path;
+    path << filepath.substr(0, split) << "-" << view << filepath.substr(split);
+    return path.str();
+}
+
+// hands the finished images (one per view) over to the writer and starts the
+// next job, exits once all jobs are done and written
+void finishJob()
+{
+    std::cout << "Job " << job + 1 << "/" << jobs.size() << " \"" << jobs[job].output << "\" " 
+        << sampleCount() << " samples";
+    if(noiseThreshold > 0.f) // samples per pixel differ
+        std::cout << " (" << static_cast<double>(tracedPaths) / (resolution[0] * resolution[1] * views) << " on average)";
+    std::cout << " in " << glutGet(GLUT_ELAPSED_TIME) - jobStart << "ms." << std::endl;
+
+    for(int view = 0; view < views; ++view)
+    {
+        Image image;
+        image.filepath = viewPath(jobs[job].output, view);
+        image.width  = viewport[0];
+        image.height = viewport[1];
+        image.pixels.resize(viewport[0] * viewport[1] * 4);
+
+        readback(view, &image.pixels[0]);
+        {
+            std::lock_guard<std::mutex> lock(writerMutex);
+            writerQueue.push_back(std::move(image));
+        }
+        writerCondition.notify_one();
+    }
+
+    if(++job < jobs.size())
+    {
+        startJob();
+        return;
+    }
+    exit(0);
+}
+
+// creates the poster output with header and full size, so tiles can be
+// written in place as they finish
+bool createPoster()
+{
+    std::ofstream stream(posterOutput, std::ios::out | std::ios::binary);
+    if(!stream)
+    {
+        std::cerr << "Write to \"" << posterOutput << "\" failed." << std::endl;
+        return false;
+    }
+    stream << "PF\n" << poster[0] << " " << poster[1] << "\n-1.0\n";
+
+    const std::streamoff size(static_cast<std::streamoff>(poster[0]) * poster[1] * 3 * sizeof(float));
+    stream.seekp(size - 1, std::ios::cur);
+    stream.put(0);
+
+    return stream.good();
+}
+
+// streams the finished tile into the poster (cropped at its borders) and 
+// starts the next tile, exits after the last one
+void finishTile()
+{
+    const GLint columns((poster[0] + posterTile - 1) / posterTile);
+    const GLint rows   ((poster[1] + posterTile - 1) / posterTile);
+
+    const GLint x0(tile % columns * posterTile);
+    const GLint y0(tile / columns * posterTile);
+    const GLint width (std::min(posterTile, poster[0] - x0));
+    const GLint height(std::min(posterTile, poster[1] - y0));
+
+    std::vector<float> pixels(posterTile * posterTile * 4);
+    readback(0, &pixels[0]);
+
+    std::fstream stream(posterOutput, std::ios::in | std::ios::out | std::ios::binary);
+    stream.seekp(0, std::ios::end);
+    const std::streamoff header(static_cast<std::streamoff>(stream.tellp()) 
+        - static_cast<std::streamoff>(poster[0]) * poster[1] * 3 * sizeof(float));
+
+    std::vector<float> rgb(width * 3);
+    for(GLint y = 0; y < height; ++y)
+    {
+        for(GLint x = 0; x < width; ++x)
+            std::copy(&pixels[(y * posterTile + x) * 4], &pixels[(y * posterTile + x) * 4 + 3], &rgb[x * 3]);
+
+        stream.seekp(header + ((static_cast<std::streamoff>(y0 + y) * poster[0]) + x0) * 3 * sizeof(float));
+        stream.write(reinterpret_cast<const char *>(&rgb[0]), rgb.size() * sizeof(float));
+    }
+    if(!stream)
+        std::cerr << "Write to \"" << posterOutput << "\" failed." << std::endl;
+
+    std::cout << "Tile " << tile + 1 << "/" << columns * rows << " written." << std::endl;
+
+    if(++tile < columns * rows)
+    {
+        clear();
+        return;
+    }
+    exit(0);
+}
 
-    const glm::vec2 viewportf(viewport[0], viewport[1]);
 
-    glViewport(0, 0, w, h);
-    glError();
+// shares and shows the resolved texture
+void display()
+{
+    share();
 
-    glUniform4f(u_viewport, viewportf.x, viewportf.y, 1.f / viewportf.x, 1.f / viewportf.y);
+    if(headless)
+    {
+        glFlush();
+        return;
+    }
 
-    // resize fbo textures
+    if(1 == views)
+    {
+        bindLayer(0);
+        glBlitFramebuffer(0, 0, resolution[0], resolution[1], 0, 0, viewport[0], viewport[1]
+            , GL_COLOR_BUFFER_BIT, 1.f == resolutionScale ? GL_NEAREST : GL_LINEAR);
+    }
+    else
+    {
+        const int columns(static_cast<int>(ceil(sqrtf(static_cast<float>(views)))));
+        const int rows((views + columns - 1) / columns);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, viewport[0], viewport[1], 0, GL_RGBA, GL_FLOAT, 0);
-    //glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, 0);
-	glError();
+        const GLint w(viewport[0] / columns);
+        const GLint h(viewport[1] / rows);
 
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);  
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);  
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); 
+        glClear(GL_COLOR_BUFFER_BIT);
+        for(int view = 0; view < views; ++view)
+        {
+            const GLint x(view % columns * w);
+            const GLint y((rows - 1 - view / columns) * h);
 
-    glError();
+            bindLayer(view);
+            glBlitFramebuffer(0, 0, resolution[0], resolution[1], x, y, x + w, y + h, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        }
+    }
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
 
-    clear();
+    glutSwapBuffers(); // FIX: causes memory leaks on single_buffering (GLUT_SINGLE) - glFlush too...
 }
 
-std::uniform_int_distribution<int> int_dist(0, static_cast<int>(1e6));
-
-// increments frame number, calcs accum factor, executes path tracing for viewport
-// by rendering the screen aligned rect into fbo with accumulation texture, while 
-// accessing it simultaneously ;D - NOTE: do not access after fragment is writen.
-// finally blits the accumulation texture to backbuffer (single buffering) and flushes.
+// increments frame number, executes path tracing for viewport by rendering the
+// screen aligned rect into the back accumulation target, adding to the sums of
+// the front one, and swaps them. The sums are averaged into the resolved texture,
+// finally blitted to backbuffer (single buffering) and flushed.
+// The result is shared with viewers if requested, headless skips the blit.
+// Multiple views are traced within the same draw, and shown side by side.
+// With a time budget, passes are dispatched in tiles over several frames.
+// With a target frame time, the resolution is reduced while moving.
+// Programs compiled in background are adopted once linked. The wavefront
+// tracer replaces the draw by its compute stages. Adaptive sampling traces
+// tiles as well, only those not converged yet, and none once all are. The
+// resolved image is denoised before it is shown, shared, or written.
 void on_display()
 {
-    glUniform1i(u_frame, ++frame);
-	glUniform1i(u_rand, int_dist(rng));
-    glUniform1f(u_accum, static_cast<float>(frame) / static_cast<float>(frame + 1));
-    
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    poll();
+    adapt();
 
-    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
-    glBlitFramebuffer(0, 0, viewport[0], viewport[1], 0, 0, viewport[0], viewport[1], GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    if(converged())
+        ; // nothing left to trace
+    else if(budget > 0.f || noiseThreshold > 0.f)
+    {
+        if(!dispatch())
+        {
+            resolve();
+            denoise();
+            display();
+            return;
+        }
+    }
+    else if(wavefront)
+    {
+        advance();
+        traceWavefront();
+        swap();
+    }
+    else
+    {
+        advance();
+    
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[1 - front]);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
-    glutSwapBuffers(); // FIX: causes memory leaks on single_buffering (GLUT_SINGLE) - glFlush too...
+        swap();
+    }
+    resolve();
+    estimate();
+    denoise();
+
+    if(spool && sampleCount() >= batchSamples)
+        spoolBatch();
+    else if(!jobs.empty() && (sampleCount() >= jobs[job].samples || converged()))
+        finishJob();
+    else if(poster[0] && (sampleCount() >= posterSamples || converged()))
+        finishTile();
+
+    display();
 }
 
 // moep
@@ -287,7 +2729,7 @@ void on_keyboard(unsigned char key,	int x, int y)
     }
 }
 
-// updates on f5 (includes clear), clears on f6
+// updates on f5 (includes clear), clears on f6, orbits on left and right
 void on_special(int key, int x,	int y)
 {
     switch(key)
@@ -299,9 +2741,15 @@ void on_special(int key, int x,	int y)
         clear();
 		break;
     case GLUT_KEY_LEFT:
+    case GLUT_KEY_RIGHT:
         {
-            angle -= 1.f;
-            clear();
+            angle += GLUT_KEY_LEFT == key ? -1.f : 1.f;
+            lastMove = glutGet(GLUT_ELAPSED_TIME);
+
+            if(reprojectHistory > 0)
+                reproject();
+            else
+                clear();
         }
 		break;
 	default:
@@ -309,183 +2757,414 @@ void on_special(int key, int x,	int y)
     }
 }
 
+// hidden windows get no display events, so headless renders directly
 void on_idle()
 {
-	glutPostRedisplay();
+    if(headless)
+        on_display();
+    else
+	    glutPostRedisplay();
 }
 
-// splits a triangle edge by adding an appropriate new point (normalized on sphere)
-// to the points list (if not already cached) and returns the index to this point.
-const glm::uint splitEdge(
-    const glm::uint a
-,   const glm::uint b
-,   std::vector<glm::vec3> & points
-,   std::hash_map<glm::highp_uint, glm::uint> & cache)
+// builds the alias table (Vose) of count weights, for selection proportional
+// to them in constant time: per column the probability of keeping its own 
+// entry, its alias, and the selection probability of the entry itself (all
+// zero for a zero sum, where every column keeps its entry)
+void aliasTable(
+    const float * weights
+,   const GLint count
+,   glm::vec4 * table)
 {
-    const bool aSmaller(a < b);
-    const glm::highp_uint smaller(aSmaller ? a : b);
-    const glm::highp_uint greater(aSmaller ? b : a);
-    const glm::highp_uint hash((smaller << 32) + greater);
+    float total(0.f);
+    for(GLint i = 0; i < count; ++i)
+        total += weights[i];
 
-    std::hash_map<glm::highp_uint, glm::uint>::const_iterator h(cache.find(hash));
-    if(cache.end() != h)
-        return h->second;
+    std::vector<float> scaled(weights, weights + count);
+    std::vector<GLint> small;
+    std::vector<GLint> large;
 
-    const glm::vec3 & a3(points[a]);
-    const glm::vec3 & b3(points[b]);
-
-    const glm::vec3 s(glm::normalize((a3 + b3) * 0.5f));
-
-    points.push_back(s);
-    const glm::uint i(static_cast<glm::uint>(points.size()) - 1);
+    for(GLint i = 0; i < count; ++i)
+    {
+        table[i] = glm::vec4(1.f, static_cast<float>(i), total > 0.f ? weights[i] / total : 0.f, 0.f);
+        scaled[i] = total > 0.f ? scaled[i] * count / total : 1.f;
+        (scaled[i] < 1.f ? small : large).push_back(i);
+    }
+    while(!small.empty() && !large.empty()) // remaining columns keep their entry
+    {
+        const GLint i(small.back());
+        const GLint j(large.back());
+        small.pop_back();
 
-    cache[hash] = i;
+        table[i].x = scaled[i];
+        table[i].y = static_cast<float>(j);
 
-    return i;
+        scaled[j] -= 1.f - scaled[i];
+        if(scaled[j] < 1.f)
+        {
+            large.pop_back();
+            small.push_back(j);
+        }
+    }
 }
 
-// creates at least minN points on a unitsphere by creating a hemi-icosphere:
-// approach to create evenly distributed points on a sphere
-//   1. create points of icosphere
-//   2. cutout hemisphere
-//   3. randomize point list
-
-void pointsOnSphere(
-    std::vector<glm::vec3> & points
-,   const unsigned int minN)
+// orders the emitters [begin, end) for as many leaves of the light tree 
+// (slots, a power of two): the leaves of the left child get the first half,
+// along the longest axis of the centroids, the right child the remainder
+void splitEmitters(
+    const std::vector<glm::vec3> & vertices
+,   const std::vector<glm::uvec4>::iterator begin
+,   const std::vector<glm::uvec4>::iterator end
+,   const GLint slots)
 {
-    // 1. create an icosphere
+    if(end - begin < 2)
+        return;
+
+    auto centroid = [&](const glm::uvec4 & triangle)
+    {
+        return vertices[triangle[0]] + vertices[triangle[1]] + vertices[triangle[2]];
+    };
 
-    static const float t = (1.f + sqrtf(5.f)) * 0.5f;
+    glm::vec3 lo(centroid(*begin));
+    glm::vec3 hi(lo);
+    for(std::vector<glm::uvec4>::iterator i = begin; i != end; ++i)
+    {
+        lo = glm::min(lo, centroid(*i));
+        hi = glm::max(hi, centroid(*i));
+    }
+    const glm::vec3 extent(hi - lo);
+    const int axis(extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2);
 
-    std::vector<glm::vec3> icopoints;
-    std::vector<glm::uvec3> icofaces;
+    const std::vector<glm::uvec4>::iterator middle(begin + std::min<ptrdiff_t>(slots / 2, end - begin));
+    std::nth_element(begin, middle, end, [&](const glm::uvec4 & a, const glm::uvec4 & b)
+    {
+        return centroid(a)[axis] < centroid(b)[axis];
+    });
 
-    // basic icosahedron
+    splitEmitters(vertices, begin, middle, slots / 2);
+    splitEmitters(vertices, middle, end, slots / 2);
+}
 
-    icopoints.push_back(glm::vec3(-1, t, 0));
-    icopoints.push_back(glm::vec3( 1, t, 0));
-    icopoints.push_back(glm::vec3(-1,-t, 0));
-    icopoints.push_back(glm::vec3( 1,-t, 0));
+// orders the emissive triangles first and builds the tables the tracer
+// selects them from for direct lighting (see selectEmitter() in trace.glsl),
+// by power - the luminance of the emission times area:
+// the alias table selects in constant time (see aliasTable()).
+// The light tree is a binary heap with the emitters as leaves (padded to a 
+// power of two) and two texels per node, bounds min and power, bounds max.
+void emitters(
+    const std::vector<glm::vec3> & vertices
+,   std::vector<glm::uvec4> & indices
+,   const std::vector<glm::vec4> & materials
+,   std::vector<glm::vec4> & aliases
+,   std::vector<glm::vec4> & nodes)
+{
+    const glm::vec3 luma(0.2126f, 0.7152f, 0.0722f); // as in resolve.frag
 
-    icopoints.push_back(glm::vec3( 0,-1, t));
-    icopoints.push_back(glm::vec3( 0, 1, t));
-    icopoints.push_back(glm::vec3( 0,-1,-t));
-    icopoints.push_back(glm::vec3( 0, 1,-t));
+    auto power = [&](const glm::uvec4 & triangle)
+    {
+        const glm::vec4 & emission(materials[triangle[3] * 3 + 1]);
+        const glm::vec3 & a(vertices[triangle[0]]);
 
-    icopoints.push_back(glm::vec3( t, 0,-1));
-    icopoints.push_back(glm::vec3( t, 0, 1));
-    icopoints.push_back(glm::vec3(-t, 0,-1));
-    icopoints.push_back(glm::vec3(-t, 0, 1));
+        return glm::dot(glm::vec3(emission.x, emission.y, emission.z), luma)
+            * 0.5f * glm::length(glm::cross(vertices[triangle[1]] - a, vertices[triangle[2]] - a));
+    };
 
-    // normalize
-    for(int i = 0; i < 12; ++i)
-        icopoints[i] = glm::normalize(icopoints[i]);
+    lightTriangles = static_cast<GLint>(std::stable_partition(indices.begin(), indices.end()
+        , [&](const glm::uvec4 & triangle) { return power(triangle) > 0.f; }) - indices.begin());
 
-    icofaces.push_back(glm::uvec3(  0, 11,  5));
-    icofaces.push_back(glm::uvec3(  0,  5,  1));
-    icofaces.push_back(glm::uvec3(  0,  1,  7));
-    icofaces.push_back(glm::uvec3(  0,  7, 10));
-    icofaces.push_back(glm::uvec3(  0, 10, 11));
+    lightTreeLevels = 0;
+    while((1 << lightTreeLevels) < lightTriangles)
+        ++lightTreeLevels;
 
-    icofaces.push_back(glm::uvec3(  1,  5,  9));
-    icofaces.push_back(glm::uvec3(  5, 11,  4));
-    icofaces.push_back(glm::uvec3( 11, 10,  2));
-    icofaces.push_back(glm::uvec3( 10,  7,  6));
-    icofaces.push_back(glm::uvec3(  7,  1,  8));
+    const GLint leaves(1 << lightTreeLevels);
+    splitEmitters(vertices, indices.begin(), indices.begin() + lightTriangles, leaves);
 
-    icofaces.push_back(glm::uvec3(  3,  9,  4));
-    icofaces.push_back(glm::uvec3(  3,  4,  2));
-    icofaces.push_back(glm::uvec3(  3,  2,  6));
-    icofaces.push_back(glm::uvec3(  3,  6,  8));
-    icofaces.push_back(glm::uvec3(  3,  8,  9));
+    // alias table
 
-    icofaces.push_back(glm::uvec3(  4,  9,  5));
-    icofaces.push_back(glm::uvec3(  2,  4, 11));
-    icofaces.push_back(glm::uvec3(  6,  2, 10));
-    icofaces.push_back(glm::uvec3(  8,  6,  7));
-    icofaces.push_back(glm::uvec3(  9,  8,  1));
+    std::vector<float> powers(lightTriangles);
+    for(GLint i = 0; i < lightTriangles; ++i)
+        powers[i] = power(indices[i]);
 
-    // iterative triangle refinement - split each triangle 
-    // into 4 new ones and create points appropriately.
+    aliases.resize(lightTriangles);
+    if(lightTriangles > 0)
+        aliasTable(&powers[0], lightTriangles, &aliases[0]);
 
-    const int r = static_cast<int>(ceil(log(static_cast<float>(minN * 2 / 12.f)) / log(4.f))); // N = 12 * 4 ^ r
+    // light tree, leaves first
 
-    std::hash_map<glm::highp_uint, glm::uint> cache;
+    nodes.assign(4 * leaves, glm::vec4(0.f));
+    for(GLint i = 0; i < lightTriangles; ++i)
+    {
+        const glm::uvec4 & triangle(indices[i]);
+        const glm::vec3 lo(glm::min(vertices[triangle[0]], glm::min(vertices[triangle[1]], vertices[triangle[2]])));
+        const glm::vec3 hi(glm::max(vertices[triangle[0]], glm::max(vertices[triangle[1]], vertices[triangle[2]])));
 
-    for(int i = 0; i < r; ++i)
+        nodes[2 * (leaves + i)    ] = glm::vec4(lo, power(triangle));
+        nodes[2 * (leaves + i) + 1] = glm::vec4(hi, 0.f);
+    }
+    for(GLint i = leaves - 1; i > 0; --i)
     {
-        const int size(static_cast<int>(icofaces.size()));
+        const glm::vec4 * l(&nodes[4 * i]); // children 2i and 2i + 1
+        const glm::vec4 * r(&nodes[4 * i + 2]);
 
-        for(int f = 0; f < size; ++f)
-        {
-            glm::uvec3 & face(icofaces[f]);
+        if(0.f == r[0].w)
+            r = l; // bounds of empty nodes are ignored
+        else if(0.f == l[0].w)
+            l = r;
+
+        nodes[2 * i    ] = glm::vec4(glm::min(glm::vec3(l[0].x, l[0].y, l[0].z), glm::vec3(r[0].x, r[0].y, r[0].z))
+            , nodes[4 * i].w + nodes[4 * i + 2].w);
+        nodes[2 * i + 1] = glm::vec4(glm::max(glm::vec3(l[1].x, l[1].y, l[1].z), glm::vec3(r[1].x, r[1].y, r[1].z)), 0.f);
+    }
+}
 
-            const glm::uint  a(face.x);
-            const glm::uint  b(face.y);
-            const glm::uint  c(face.z);
+// builds the alias tables of the environment: per row one over its texels,
+// weighted by luminance times the sine of their polar angle, whose selection
+// probability (z) is scaled to the joint one of the texel, and one over the
+// rows weighted by their sums
+void environmentTables(
+    const GLint width
+,   const GLint height
+,   const std::vector<float> & rgb
+,   std::vector<glm::vec4> & table
+,   std::vector<glm::vec4> & rows)
+{
+    const glm::vec3 luma(0.2126f, 0.7152f, 0.0722f); // as in resolve.frag
 
-            const glm::uint ab(splitEdge(a, b, icopoints, cache));
-            const glm::uint bc(splitEdge(b, c, icopoints, cache));
-            const glm::uint ca(splitEdge(c, a, icopoints, cache));
+    std::vector<float> weights(width * height);
+    std::vector<float> sums(height, 0.f);
 
-            face = glm::uvec3(ab, bc, ca);
+    for(GLint y = 0; y < height; ++y)
+    {
+        const float sine(sin(3.14159265f * (1.f - (y + 0.5f) / height))); // rows from the bottom
 
-            icofaces.push_back(glm::uvec3(a, ab, ca));
-            icofaces.push_back(glm::uvec3(b, bc, ab));
-            icofaces.push_back(glm::uvec3(c, ca, bc));
+        for(GLint x = 0; x < width; ++x)
+        {
+            const GLint i(y * width + x);
+            sums[y] += weights[i] = glm::dot(glm::vec3(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]), luma) * sine;
         }
     }
 
-    // 2. remove lower hemisphere
-
-    const int size(static_cast<int>(icopoints.size()));
-    for(int i = 0; i < size; ++i)
-        if(icopoints[i].y > 0.f)
-            points.push_back(icopoints[i]);
+    table.resize(width * height);
+    rows.resize(height);
 
-    // 3. shuffle all points of hemisphere
+    for(GLint y = 0; y < height; ++y)
+        aliasTable(&weights[y * width], width, &table[y * width]);
+    aliasTable(&sums[0], height, &rows[0]);
 
-    std::shuffle(points.begin(), points.end(), rng);
+    for(GLint y = 0; y < height; ++y)
+        for(GLint x = 0; x < width; ++x)
+            table[y * width + x].z *= rows[y].z;
 }
 
-void pointsInLight(
-	std::vector<glm::vec3> & lights
-,	const glm::vec3 & llf
-,	const glm::vec3 & urb
-,	const int minN)
+// command line options (remaining after glut consumed its own):
+//   --headless            render without showing the window
+//   --shm [name]          publish the image to shared memory (default "/pathgl")
+//   --shm-interval <ms>   minimum time between two publishes
+//   --worker <spool>      render sample batches into the spool directory (headless)
+//   --coordinator <spool> merge batches from the spool directory (no window)
+//   --batch <n>           samples per pixel of a worker batch
+//   --samples <n>         samples per pixel the coordinator finishes at
+//   --output <file.pfm>   image written by the coordinator
+//   --seed <n>            random seed, distinct per worker by default
+//   --jobs <file>         render all jobs of the file back-to-back, then exit
+//   --stereo <separation> trace a parallel stereo pair in one pass
+//   --lightfield <n> <spacing> trace an n x n camera grid in one pass
+//   --cubemap             trace the six cube faces around the eye in one pass (square window)
+//   --poster <width> <height> <samples> <file.pfm> render a large image tile by tile (headless)
+//   --tile <n>            edge length of poster tiles
+//   --half                half float resolved image (sums stay single precision)
+//   --budget <ms> [tile]  trace passes in tiles, as many per frame as fit the budget
+//   --spp <k>             paths per pixel traced in each pass
+//   --dynamic <ms> [min]  reduce the traced resolution while moving or too slow to meet the frame time
+//   --bounces <n>         maximum path length
+//   --min-bounces <n>     path length before russian roulette (default 2, fixed length if >= bounces)
+//   --no-culling          intersect triangles from both sides
+//   --glossy <exponent>   half the reflectance of the tall block as phong lobe of the exponent
+//   --light-tree          select emitters by a light tree instead of the alias table
+//   --environment <file.pfm> [scale] light escaping rays by an equirectangular hdr map
+//   --no-ceiling          leave out the ceiling, opening the room towards the environment
+//   --cache <dir>         directory of the program binary cache (default $XDG_CACHE_HOME/pathgl)
+//   --no-cache            always compile programs from source
+//   --wavefront           trace with compute stages and ray queues (OpenGL 4.3)
+//   --adaptive <noise> [tile] skip tiles once their noise is below the threshold, jobs and
+//                         poster tiles finish when all converged (samples as maximum)
+//   --denoise [n]         filter the image in n a-trous iterations guided by first hit features (default 5)
+//   --reproject [history] carry samples over on camera changes, at most history per pixel (default 32)
+//   --raster [variants]   rasterize the first hits once per camera change, variants > 1 jitter them (default 1)
+//   --restir [candidates] resample the direct lighting of first hits from candidates and reservoirs (default 8)
+//   --guide [resolution]  sample bounces from directions learned per cell of a grid over the scene (OpenGL 4.3,
+//                         default 16 cells per axis)
+//   --radiance-cache [bounce] [resolution] end paths at the bounce (default 2) in radiance cached per cell
+//                         of a grid over the scene (OpenGL 4.3, default 32 cells per axis)
+void parse(int argc, char** argv)
 {
-	glm::vec3 min, max;
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string arg(argv[i]);
+        const bool value(i + 1 < argc && '-' != argv[i + 1][0]);
+
+        if("--headless" == arg)
+            headless = true;
+        else if("--shm" == arg)
+            shmName = value ? argv[++i] : "/pathgl";
+        else if("--shm-interval" == arg && value)
+            shmInterval = atoi(argv[++i]);
+        else if("--worker" == arg && value)
+        {
+            spool = argv[++i];
+            headless = true;
+        }
+        else if("--coordinator" == arg && value)
+        {
+            spool = argv[++i];
+            coordinator = true;
+        }
+        else if("--batch" == arg && value)
+            batchSamples = std::max(1, atoi(argv[++i]));
+        else if("--samples" == arg && value)
+            targetSamples = atoi(argv[++i]);
+        else if("--output" == arg && value)
+            output = argv[++i];
+        else if("--seed" == arg && value)
+            seed = strtoul(argv[++i], nullptr, 10);
+        else if("--jobs" == arg && value)
+            jobFile = argv[++i];
+        else if("--stereo" == arg && value)
+        {
+            viewLayout = StereoViews;
+            views = 2;
+            viewSpacing = static_cast<float>(atof(argv[++i]));
+        }
+        else if("--lightfield" == arg && i + 2 < argc)
+        {
+            const int n(glm::clamp(atoi(argv[++i]), 1, 4));
 
-	min = glm::min(llf, urb);
-	max = glm::max(llf, urb);
+            viewLayout = LightfieldViews;
+            views = n * n;
+            viewSpacing = static_cast<float>(atof(argv[++i]));
+        }
+        else if("--cubemap" == arg)
+        {
+            viewLayout = CubemapViews;
+            views = 6;
+        }
+        else if("--poster" == arg && i + 4 < argc)
+        {
+            poster[0] = std::max(1, atoi(argv[++i]));
+            poster[1] = std::max(1, atoi(argv[++i]));
+            posterSamples = std::max(1, atoi(argv[++i]));
+            posterOutput = argv[++i];
+            headless = true;
+        }
+        else if("--tile" == arg && value)
+            posterTile = std::max(1, atoi(argv[++i]));
+        else if("--half" == arg)
+            halfFloat = true;
+        else if("--budget" == arg && value)
+        {
+            budget = static_cast<float>(atof(argv[++i]));
+            if(i + 1 < argc && '-' != argv[i + 1][0])
+                budgetTile = std::max(8, atoi(argv[++i]));
+        }
+        else if("--spp" == arg && value)
+            samplesPerPass = std::max(1, atoi(argv[++i]));
+        else if("--dynamic" == arg && value)
+        {
+            targetFrameTime = static_cast<float>(atof(argv[++i]));
+            if(i + 1 < argc && '-' != argv[i + 1][0])
+                minScale = glm::clamp(static_cast<float>(atof(argv[++i])), 0.05f, 1.f);
+        }
+        else if("--bounces" == arg && value)
+            bounces = std::max(1, atoi(argv[++i]));
+        else if("--min-bounces" == arg && value)
+            minBounces = std::max(1, atoi(argv[++i]));
+        else if("--no-culling" == arg)
+            backfaceCulling = false;
+        else if("--glossy" == arg && value)
+            glossiness = std::max(1.f, static_cast<float>(atof(argv[++i])));
+        else if("--light-tree" == arg)
+            lightTree = true;
+        else if("--environment" == arg && value)
+        {
+            environmentPath = argv[++i];
+            if(i + 1 < argc && '-' != argv[i + 1][0])
+                environmentScale = static_cast<float>(atof(argv[++i]));
+        }
+        else if("--no-ceiling" == arg)
+            ceiling = false;
+        else if("--cache" == arg && value)
+            cacheDir = argv[++i];
+        else if("--no-cache" == arg)
+            cacheDir = nullptr;
+        else if("--wavefront" == arg)
+            wavefront = true;
+        else if("--denoise" == arg)
+            denoiseIterations = value ? glm::clamp(atoi(argv[++i]), 1, 8) : 5;
+        else if("--raster" == arg)
+            primaryVariants = value ? glm::clamp(atoi(argv[++i]), 1, 16) : 1;
+        else if("--reproject" == arg)
+            reprojectHistory = value ? std::max(1, atoi(argv[++i])) : 32;
+        else if("--restir" == arg)
+            restirCandidates = value ? glm::clamp(atoi(argv[++i]), 1, 32) : 8;
+        else if("--guide" == arg)
+            guideResolution = value ? glm::clamp(atoi(argv[++i]), 1, 512) : 16;
+        else if("--radiance-cache" == arg)
+        {
+            cacheResolution = 32;
+            if(value)
+                cacheBounce = std::max(1, atoi(argv[++i]));
+            if(value && i + 1 < argc && '-' != argv[i + 1][0])
+                cacheResolution = glm::clamp(atoi(argv[++i]), 1, 512);
+        }
+        else if("--adaptive" == arg && value)
+        {
+            noiseThreshold = static_cast<float>(atof(argv[++i]));
+            if(i + 1 < argc && '-' != argv[i + 1][0])
+                budgetTile = std::max(8, atoi(argv[++i]));
+        }
+        else if(0 == arg.compare(0, 2, "--")) // others are glut's
+            std::cerr << "Unknown option \"" << arg << "\" ignored." << std::endl;
+    }
+}
 
-	glm::vec3 size = max - min;
+// initialization
+int main(int argc, char** argv)
+{
+    parse(argc, argv);
 
-	const int r = static_cast<int>(ceil(sqrtf(static_cast<float>(minN))));
+    if(cacheDir && !*cacheDir)
+        cacheDir = userCacheDir();
 
-	glm::vec3 step(size / static_cast<float>(r - 1));
+    if(coordinator)
+        return coordinate();
 
-	for(float x = min.x; x <= max.x; x += step.x)
-		for(float z = min.z; z <= max.z; z += step.z)
-			lights.push_back(glm::vec3(x, glm::linearRand(min.y, max.y), z));
+    if(jobFile && !loadJobs(jobFile))
+        return 1;
 
-    // 2. shuffle all points
+    if(poster[0])
+    {
+        if(!createPoster())
+            return 1;
 
-    std::shuffle(lights.begin(), lights.end(), rng);
-}
+        viewport[0] = viewport[1] = posterTile;
+        resolution[0] = resolution[1] = posterTile;
+    }
 
-// initialization
-int main(int argc, char** argv)
-{
-	rng.seed(static_cast<unsigned long>(time(NULL)));
+    if(0 == seed) // time alone would correlate workers started together
+        seed = static_cast<unsigned long>(time(NULL)) ^ std::random_device()();
+	rng.seed(seed);
 
     // GLUT & GLEW
 
+#ifndef WIN32
+    XInitThreads(); // the compile worker makes its context current concurrently
+#endif
 	glutInit(&argc, argv);
 
-    glutInitContextVersion(3, 1);
-    //glutInitContextProfile(GLUT_COMPATIBILITY_PROFILE);
+    if(wavefront || guideResolution > 0 || cacheResolution > 0)
+        glutInitContextVersion(4, 3); // compute shader and shader storage
+    else
+        glutInitContextVersion(3, 2); // layered rendering
+    glutInitContextProfile(GLUT_CORE_PROFILE);
     //glutInitContextFlags(GLUT_FORWARD_COMPATIBLE);
 
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE);
@@ -494,6 +3173,81 @@ int main(int argc, char** argv)
     glutCreateWindow("Minimal GLSL Path Tracer v1 - Daniel Limberger");
     glewInit();
 
+    if(headless)
+        glutHideWindow();
+
+    driver = std::string(reinterpret_cast<const char *>(glGetString(GL_VENDOR))) + " "
+           + reinterpret_cast<const char *>(glGetString(GL_RENDERER)) + " "
+           + reinterpret_cast<const char *>(glGetString(GL_VERSION));
+
+    if(createCompileContext())
+        atexit(joinCompiler);
+    else
+        std::cerr << "Shared context unavailable, shaders are compiled on the render thread." << std::endl;
+
+    if(budget > 0.f && !GLEW_ARB_timer_query)
+    {
+        std::cerr << "Timer queries unsupported, time budget ignored." << std::endl;
+        budget = 0.f;
+    }
+
+    if(wavefront && !GLEW_VERSION_4_3)
+    {
+        std::cerr << "OpenGL 4.3 unsupported, wavefront tracer disabled." << std::endl;
+        wavefront = false;
+    }
+    if(guideResolution > 0 && !GLEW_VERSION_4_3)
+    {
+        std::cerr << "OpenGL 4.3 unsupported, path guiding disabled." << std::endl;
+        guideResolution = 0;
+    }
+    if(cacheResolution > 0 && !GLEW_VERSION_4_3)
+    {
+        std::cerr << "OpenGL 4.3 unsupported, radiance cache disabled." << std::endl;
+        cacheResolution = 0;
+    }
+    if(wavefront && guideResolution > 0)
+    {
+        std::cerr << "Wavefront tracer samples bounces by the brdf, guiding ignored." << std::endl;
+        guideResolution = 0;
+    }
+    if(wavefront && cacheResolution > 0)
+    {
+        std::cerr << "Wavefront tracer traces full paths, radiance cache ignored." << std::endl;
+        cacheResolution = 0;
+    }
+    if(wavefront && budget > 0.f)
+    {
+        std::cerr << "Wavefront tracer traces full passes, time budget ignored." << std::endl;
+        budget = 0.f;
+    }
+    if(wavefront && noiseThreshold > 0.f)
+    {
+        std::cerr << "Wavefront tracer traces full passes, adaptive sampling ignored." << std::endl;
+        noiseThreshold = 0.f;
+    }
+    if(spool && noiseThreshold > 0.f)
+    {
+        std::cerr << "Workers trace fixed batches, adaptive sampling ignored." << std::endl;
+        noiseThreshold = 0.f;
+    }
+    if(wavefront && primaryVariants > 0)
+    {
+        std::cerr << "Wavefront tracer generates primary rays, rasterization ignored." << std::endl;
+        primaryVariants = 0;
+    }
+    if(wavefront && restirCandidates > 0)
+    {
+        std::cerr << "Wavefront tracer samples emitters per bounce, resampling ignored." << std::endl;
+        restirCandidates = 0;
+    }
+    if(primaryVariants > 1 && restirCandidates > 0)
+    {
+        std::cerr << "Jittered first hits differ per path, resampling ignored." << std::endl;
+        restirCandidates = 0;
+    }
+    featureBuffers = denoiseIterations > 0 || reprojectHistory > 0;
+
     // disable vsync
 #ifdef WIN32
     wglSwapIntervalEXT(0);
@@ -511,51 +3265,339 @@ int main(int argc, char** argv)
     // RECT
 
     static const GLfloat vs[] = {+1.f,-1.f, 0.f,+1.f,+1.f, 0.f,-1.f,-1.f, 0.f,-1.f,+1.f, 0.f};
+    glGenVertexArrays(1, &vertexarray);
+    glBindVertexArray(vertexarray);
+
     glGenBuffers(1, &rect);
     glBindBuffer(GL_ARRAY_BUFFER, rect);
     glBufferData(GL_ARRAY_BUFFER, 12 * sizeof(GLfloat), vs, GL_STATIC_DRAW);
     glError();
 
-    // CREATE FBO
+    // CREATE FBOs (sums bound to the resolve units 6 and 7 for good)
 
-    glActiveTexture(GL_TEXTURE0);
+    glGenTextures(2, sums);
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, viewport[0], viewport[1], 0, GL_RGBA, GL_FLOAT, 0);
-    glError();
-    
+    glGenFramebuffers(2, framebuffers);
     glGenFramebuffers(1, &framebuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
-    glError();
 
-    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    const GLuint textures[3] = { sums[0], sums[1], texture };
+    const GLuint targets[3] = { framebuffers[0], framebuffers[1], framebuffer };
+    for(int i = 0; i < 3; ++i)
+    {
+        glActiveTexture(GL_TEXTURE6 + i);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textures[i]);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, halfFloat && texture == textures[i] ? GL_RGBA16F : GL_RGBA32F
+            , viewport[0], viewport[1], views, 0, GL_RGBA, GL_FLOAT, 0);
+        glError();
+    
+        glBindFramebuffer(GL_FRAMEBUFFER, targets[i]);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, textures[i], 0);
+        glError();
+
+        const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glError();
+        if(GL_FRAMEBUFFER_COMPLETE != status)
+            std::cerr << "Frame Buffer Object incomplete." << std::endl;
+    }
+
+    // ADAPTIVE SAMPLING (moments bound to units 8 and 9 for good, see advance())
+
+    if(noiseThreshold > 0.f)
+    {
+        glGenTextures(2, moments);
+        glGenTextures(1, &noise);
+
+        const GLuint estimates[3] = { moments[0], moments[1], noise };
+        for(int i = 0; i < 3; ++i)
+        {
+            glActiveTexture(GL_TEXTURE8 + i);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, estimates[i]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, viewport[0], viewport[1], views, 0, GL_RED, GL_FLOAT, 0);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glError();
+
+            glBindFramebuffer(GL_FRAMEBUFFER, targets[i]);
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, estimates[i], 0);
+            glError();
+        }
+        glGenBuffers(1, &noisePBO);
+    }
+
+    // FEATURES AND DENOISING (features bound to units 11 and 12 for good)
+
+    if(featureBuffers)
+    {
+        glGenTextures(1, &albedos);
+        glGenTextures(1, &normals);
+
+        const GLuint features[2] = { albedos, normals };
+        const GLenum formats[2] = { GL_RGBA16F, GL_RGBA32F };
+        for(int i = 0; i < 2; ++i)
+        {
+            glActiveTexture(GL_TEXTURE11 + i);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, features[i]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, formats[i], viewport[0], viewport[1], views, 0, GL_RGBA, GL_FLOAT, 0);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glError();
+
+            for(int j = 0; j < 2; ++j) // same features for both targets
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[j]);
+                glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2 + i, features[i], 0);
+            }
+            glError();
+        }
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    // RESAMPLING (reservoirs bound to units 15 to 18 for good, see advance())
+
+    if(restirCandidates > 0)
+    {
+        glGenTextures(2, reservoirs);
+        glGenTextures(2, reservoirCounts);
+
+        const GLuint resampling[4] = { reservoirs[0], reservoirs[1], reservoirCounts[0], reservoirCounts[1] };
+        for(int i = 0; i < 4; ++i)
+        {
+            glActiveTexture(GL_TEXTURE15 + i);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, resampling[i]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA32F, viewport[0], viewport[1], views, 0, GL_RGBA, GL_FLOAT, 0);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glError();
+
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i % 2]);
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4 + i / 2, resampling[i], 0);
+            glError();
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    if(denoiseIterations > 0)
+    {
+        glGenTextures(2, filtered);
+        glGenFramebuffers(2, filterbuffers);
+
+        for(int i = 0; i < 2; ++i)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, filtered[i]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, halfFloat ? GL_RGBA16F : GL_RGBA32F
+                , viewport[0], viewport[1], views, 0, GL_RGBA, GL_FLOAT, 0);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glError();
+
+            glBindFramebuffer(GL_FRAMEBUFFER, filterbuffers[i]);
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, filtered[i], 0);
+            glError();
+        }
+    }
+
+    // outputs of tracer (color, moments, features, reservoirs) and resolve (color, noise)
+
+    const GLenum buffers[6] = { GL_COLOR_ATTACHMENT0
+        , static_cast<GLenum>(noiseThreshold > 0.f ? GL_COLOR_ATTACHMENT1 : GL_NONE)
+        , static_cast<GLenum>(featureBuffers ? GL_COLOR_ATTACHMENT2 : GL_NONE)
+        , static_cast<GLenum>(featureBuffers ? GL_COLOR_ATTACHMENT3 : GL_NONE)
+        , static_cast<GLenum>(restirCandidates > 0 ? GL_COLOR_ATTACHMENT4 : GL_NONE)
+        , static_cast<GLenum>(restirCandidates > 0 ? GL_COLOR_ATTACHMENT5 : GL_NONE) };
+
+    for(int i = 0; i < 3; ++i)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, targets[i]);
+        glDrawBuffers(framebuffer == targets[i] ? 2 : 6, buffers);
+
+        if(GL_FRAMEBUFFER_COMPLETE != glCheckFramebufferStatus(GL_FRAMEBUFFER))
+            std::cerr << "Frame Buffer Object incomplete." << std::endl;
+    }
+    glActiveTexture(GL_TEXTURE0);
     glError();
-    if(GL_FRAMEBUFFER_COMPLETE != status)
-        std::cerr << "Frame Buffer Object incomplete." << std::endl;
+
+    // PRIMARY VISIBILITY (hits bound to unit 14 for good, layers attached when rasterized)
+
+    if(primaryVariants > 0)
+    {
+        glGenTextures(1, &hits);
+        glGenRenderbuffers(1, &hitDepth);
+        glGenFramebuffers(1, &primarybuffer);
+        glGenVertexArrays(1, &primaryarray);
+
+        glActiveTexture(GL_TEXTURE14);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, hits);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA32F, viewport[0], viewport[1], views * primaryVariants, 0, GL_RGBA, GL_FLOAT, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glActiveTexture(GL_TEXTURE0);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, hitDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, viewport[0], viewport[1]);
+        glError();
+
+        glBindFramebuffer(GL_FRAMEBUFFER, primarybuffer);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, hits, 0, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, hitDepth);
+
+        if(GL_FRAMEBUFFER_COMPLETE != glCheckFramebufferStatus(GL_FRAMEBUFFER))
+            std::cerr << "Frame Buffer Object incomplete." << std::endl;
+        glError();
+    }
+
+    if(reprojectHistory > 0) // attached to the back target when used
+    {
+        glGenFramebuffers(1, &reprojectbuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, reprojectbuffer);
+        glDrawBuffers(noiseThreshold > 0.f ? 2 : 1, buffers);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    shown = texture;
+
+    glGenFramebuffers(1, &layerbuffer);
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
     glError();
 
-    // SHADER
+    // WAVEFRONT BUFFERS (allocated on reshape)
+
+    if(wavefront)
+    {
+        glGenBuffers(1, &wavefrontPaths);
+        glGenBuffers(1, &wavefrontQueues);
+        glGenBuffers(1, &wavefrontShadows);
+        glGenBuffers(1, &wavefrontCounters);
+    }
+
+    // GUIDE BUFFERS (trained over the whole run, see learn())
+
+    if(guideResolution > 0)
+    {
+        const std::vector<GLuint> zeros(GUIDE_SLOTS * (GUIDE_BINS + 1 + GUIDE_FRACTIONS), 0);
+
+        glGenBuffers(1, &guideKeys);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, guideKeys);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, GUIDE_SLOTS * sizeof(GLuint), &zeros[0], GL_DYNAMIC_COPY);
+
+        glGenBuffers(1, &guideTraining);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, guideTraining);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, GUIDE_SLOTS * (GUIDE_BINS + 1 + GUIDE_FRACTIONS) * sizeof(GLuint), &zeros[0], GL_DYNAMIC_COPY);
+
+        glGenBuffers(1, &guideLearned);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, guideLearned);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, GUIDE_SLOTS * (GUIDE_BINS + 1) * sizeof(GLfloat), &zeros[0], GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, guideKeys);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, guideTraining);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, guideLearned);
+        glError();
+    }
+
+    // CACHE BUFFERS (trained over the whole run, see gather() and invalidate())
+
+    if(cacheResolution > 0)
+    {
+        const std::vector<GLuint> zeros(CACHE_SLOTS * 6, 0);
+
+        glGenBuffers(1, &cacheKeys);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, cacheKeys);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, CACHE_SLOTS * sizeof(GLuint), &zeros[0], GL_DYNAMIC_COPY);
+
+        glGenBuffers(1, &cacheTraining);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, cacheTraining);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, CACHE_SLOTS * 6 * sizeof(GLuint), &zeros[0], GL_DYNAMIC_COPY);
+
+        glGenBuffers(1, &cacheLearned);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, cacheLearned);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, CACHE_SLOTS * 4 * sizeof(GLfloat), &zeros[0], GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, cacheKeys);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, cacheTraining);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, cacheLearned);
+        glError();
+    }
+
+    // SHARED MEMORY
+
+    if(shmName)
+    {
+        glGenBuffers(1, &shmPBO);
+        atexit(unpublish);
+    }
+
+    // SHADER (trace programs are specialized on the scene, see update())
     
     tracevert = glCreateShader(GL_VERTEX_SHADER);
-    tracefrag = glCreateShader(GL_FRAGMENT_SHADER);
-    traceprog = glCreateProgram();
+    tracegeom = glCreateShader(GL_GEOMETRY_SHADER);
+    resolvefrag = glCreateShader(GL_FRAGMENT_SHADER);
+    resolveprog = glCreateProgram();
     glError();
 
-    glAttachShader(traceprog, tracevert);
-    glAttachShader(traceprog, tracefrag);
+    glAttachShader(resolveprog, tracevert);
+    glAttachShader(resolveprog, tracegeom);
+    glAttachShader(resolveprog, resolvefrag);
     glError();
 
-    update();
+    if(denoiseIterations > 0)
+    {
+        denoisefrag = glCreateShader(GL_FRAGMENT_SHADER);
+        denoiseprog = glCreateProgram();
+
+        glAttachShader(denoiseprog, tracevert);
+        glAttachShader(denoiseprog, tracegeom);
+        glAttachShader(denoiseprog, denoisefrag);
+        glError();
+    }
+
+    if(primaryVariants > 0)
+    {
+        primaryvert = glCreateShader(GL_VERTEX_SHADER);
+        primaryfrag = glCreateShader(GL_FRAGMENT_SHADER);
+        primaryprog = glCreateProgram();
+
+        glAttachShader(primaryprog, primaryvert);
+        glAttachShader(primaryprog, primaryfrag);
+        glError();
+    }
+
+    if(guideResolution > 0)
+    {
+        guidecomp = glCreateShader(GL_COMPUTE_SHADER);
+        guideprog = glCreateProgram();
+
+        glAttachShader(guideprog, guidecomp);
+        glError();
+    }
+
+    if(cacheResolution > 0)
+    {
+        cachecomp = glCreateShader(GL_COMPUTE_SHADER);
+        cacheprog = glCreateProgram();
+
+        glAttachShader(cacheprog, cachecomp);
+        glError();
+    }
+
+    if(reprojectHistory > 0)
+    {
+        reprojectfrag = glCreateShader(GL_FRAGMENT_SHADER);
+        reprojectprog = glCreateProgram();
+
+        glAttachShader(reprojectprog, tracevert);
+        glAttachShader(reprojectprog, tracegeom);
+        glAttachShader(reprojectprog, reprojectfrag);
+        glError();
+    }
 
     // CONFIG
 
     glDisable(GL_DEPTH_TEST);
     glDepthMask(GL_FALSE);
 
-    const int a_vertex = glGetAttribLocation(traceprog, "a_vertex");
+    const int a_vertex = 0; // bound for all programs in update()
 
     glBindBuffer(GL_ARRAY_BUFFER, rect);
     glVertexAttribPointerARB(a_vertex, 3, GL_FLOAT, 0, 0, 0);
@@ -569,10 +3611,10 @@ int main(int argc, char** argv)
 
 	std::vector<glm::vec3> vertices;
 	// lights
-	vertices.push_back(glm::vec3( 343.0, 448.8, 227.0)); // 00
-	vertices.push_back(glm::vec3( 343.0, 548.8, 332.0)); // 01
-	vertices.push_back(glm::vec3( 213.0, 548.8, 332.0)); // 02
-	vertices.push_back(glm::vec3( 213.0, 548.8, 227.0)); // 03
+	vertices.push_back(glm::vec3( 343.0, 548.7, 227.0)); // 00
+	vertices.push_back(glm::vec3( 343.0, 548.7, 332.0)); // 01
+	vertices.push_back(glm::vec3( 213.0, 548.7, 332.0)); // 02
+	vertices.push_back(glm::vec3( 213.0, 548.7, 227.0)); // 03
 	// room
 	vertices.push_back(glm::vec3(   0.0,   0.0,   0.0)); // 04 
 	vertices.push_back(glm::vec3(   0.0,   0.0, 559.2)); // 05 
@@ -606,8 +3648,11 @@ int main(int argc, char** argv)
 	indices.push_back(glm::uvec4(  0,  1,  2, 0));
 	indices.push_back(glm::uvec4(  0,  2,  3, 0));
 	// room ceiling
-	indices.push_back(glm::uvec4( 10, 11,  7, 1));
-	indices.push_back(glm::uvec4( 10,  7,  6, 1));
+	if(ceiling)
+	{
+		indices.push_back(glm::uvec4( 10, 11,  7, 1));
+		indices.push_back(glm::uvec4( 10,  7,  6, 1));
+	}
 	// room floor
 	indices.push_back(glm::uvec4(  8,  4,  5, 1));
 	indices.push_back(glm::uvec4(  8,  5,  9, 1));
@@ -635,22 +3680,66 @@ int main(int argc, char** argv)
 	indices.push_back(glm::uvec4( 14, 15, 17, 1));
 	indices.push_back(glm::uvec4( 14, 17, 16, 1));
 	// tall block
-	indices.push_back(glm::uvec4( 27, 25, 23, 1));
-	indices.push_back(glm::uvec4( 27, 23, 21, 1));
-	indices.push_back(glm::uvec4( 20, 21, 23, 1));
-	indices.push_back(glm::uvec4( 20, 23, 22, 1));
-	indices.push_back(glm::uvec4( 26, 27, 21, 1));
-	indices.push_back(glm::uvec4( 26, 21, 20, 1));
-	indices.push_back(glm::uvec4( 24, 25, 27, 1));
-	indices.push_back(glm::uvec4( 24, 27, 26, 1));
-	indices.push_back(glm::uvec4( 22, 23, 25, 1));
-	indices.push_back(glm::uvec4( 22, 25, 24, 1));
-
-	std::vector<glm::vec4> colors;
-	colors.push_back(glm::vec4(0.0, 0.0, 0.0, 1.0)); // 0 black
-	colors.push_back(glm::vec4(1.0, 1.0, 1.0, 1.0)); // 1 white
-	colors.push_back(glm::vec4(1.0, 0.0, 0.0, 1.0)); // 2 red
-	colors.push_back(glm::vec4(0.0, 1.0, 0.0, 1.0)); // 3 green
+	indices.push_back(glm::uvec4( 27, 25, 23, 4));
+	indices.push_back(glm::uvec4( 27, 23, 21, 4));
+	indices.push_back(glm::uvec4( 20, 21, 23, 4));
+	indices.push_back(glm::uvec4( 20, 23, 22, 4));
+	indices.push_back(glm::uvec4( 26, 27, 21, 4));
+	indices.push_back(glm::uvec4( 26, 21, 20, 4));
+	indices.push_back(glm::uvec4( 24, 25, 27, 4));
+	indices.push_back(glm::uvec4( 24, 27, 26, 4));
+	indices.push_back(glm::uvec4( 22, 23, 25, 4));
+	indices.push_back(glm::uvec4( 22, 25, 24, 4));
+
+	// materials: diffuse albedo, emission, specular albedo and phong exponent
+	const glm::vec4 black(0.0, 0.0, 0.0, 0.0);
+
+	std::vector<glm::vec4> materials;
+	materials.push_back(black); // 0 light
+	materials.push_back(glm::vec4(glm::vec3(16.0), 0.0));
+	materials.push_back(black);
+	materials.push_back(glm::vec4(1.0, 1.0, 1.0, 1.0)); // 1 white
+	materials.push_back(black);
+	materials.push_back(black);
+	materials.push_back(glm::vec4(1.0, 0.0, 0.0, 1.0)); // 2 red
+	materials.push_back(black);
+	materials.push_back(black);
+	materials.push_back(glm::vec4(0.0, 1.0, 0.0, 1.0)); // 3 green
+	materials.push_back(black);
+	materials.push_back(black);
+
+	const float specular(glossiness > 0.f ? 0.5f : 0.f); // 4 tall block, white or glossy
+	materials.push_back(glm::vec4(glm::vec3(1.f - specular), 1.0));
+	materials.push_back(black);
+	materials.push_back(glm::vec4(glm::vec3(specular), glossiness));
+
+	// EMITTERS (ordered first, selected in the tracer, see selectEmitter())
+
+	std::vector<glm::vec4> aliases;
+	std::vector<glm::vec4> nodes;
+	emitters(vertices, indices, materials, aliases, nodes);
+
+	// GUIDE AND CACHE GRIDS (cubic cells over the scene bounds, slightly enlarged)
+
+	if(guideResolution > 0 || cacheResolution > 0)
+	{
+		glm::vec3 lower(vertices[0]);
+		glm::vec3 upper(vertices[0]);
+		for(size_t i = 1; i < vertices.size(); ++i)
+		{
+			lower = glm::min(lower, vertices[i]);
+			upper = glm::max(upper, vertices[i]);
+		}
+		const glm::vec3 extent(upper - lower);
+
+		const float edge(std::max(extent.x, std::max(extent.y, extent.z)) * 1.01f);
+
+		guideCell = edge / std::max(guideResolution, 1);
+		guideOrigin = lower - extent * 0.005f;
+
+		cacheCell = edge / std::max(cacheResolution, 1);
+		cacheOrigin = guideOrigin;
+	}
 
 	// CREATE TEXTURES
 
@@ -669,6 +3758,8 @@ int main(int argc, char** argv)
 
 	glGenTextures(1, &indicesImage);
 	glBindTexture(GL_TEXTURE_1D, indicesImage);
+    triangles = static_cast<GLint>(indices.size());
+
 	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8UI, static_cast<GLsizei>(indices.size())
 		, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, &indices[0]);
 	glError();
@@ -678,57 +3769,100 @@ int main(int argc, char** argv)
 
 	glActiveTexture(GL_TEXTURE3);
 
-	glGenTextures(1, &colorsImage);
-	glBindTexture(GL_TEXTURE_1D, colorsImage);
-	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, static_cast<GLsizei>(colors.size())
-		, 0, GL_RGBA, GL_FLOAT, &colors[0]);
+	glGenTextures(1, &materialsImage);
+	glBindTexture(GL_TEXTURE_1D, materialsImage);
+	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, static_cast<GLsizei>(materials.size())
+		, 0, GL_RGBA, GL_FLOAT, &materials[0]);
 	glError();
 	glTexParameterf(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);  
 	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
 	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
-    // CREATE HEMISPHERE PATH SAMPLES
-
-    std::vector<glm::vec3> points;
-    pointsOnSphere(points, static_cast<unsigned int>(1e4));
-
-    GLsizei samplerSize = static_cast<GLsizei>(sqrt(points.size()));
-    while(points.size() > samplerSize * samplerSize)
-        points.pop_back();
-
 	glActiveTexture(GL_TEXTURE4);
 
-	glGenTextures(1, &hsphereImage);
-	glBindTexture(GL_TEXTURE_2D, hsphereImage);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, samplerSize, samplerSize
-		, 0, GL_RGB, GL_FLOAT, &points[0]);
+	glGenTextures(1, &emittersImage);
+	glBindTexture(GL_TEXTURE_1D, emittersImage);
+	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, static_cast<GLsizei>(aliases.size())
+		, 0, GL_RGBA, GL_FLOAT, &aliases[0]);
 	glError();
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);  
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);  
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-    // CREATE LIGHT AREA SAMPLES
-
-    std::vector<glm::vec3> lights;
-    pointsInLight(lights, vertices[0], vertices[2], 32 * 32);
+	glTexParameterf(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);  
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
 	glActiveTexture(GL_TEXTURE5);
 
-	glGenTextures(1, &lightsImage);
-	glBindTexture(GL_TEXTURE_2D, lightsImage);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, 32, 32
-		, 0, GL_RGB, GL_FLOAT, &lights[0]);
+	glGenTextures(1, &lightTreeImage);
+	glBindTexture(GL_TEXTURE_1D, lightTreeImage);
+	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, static_cast<GLsizei>(nodes.size())
+		, 0, GL_RGBA, GL_FLOAT, &nodes[0]);
 	glError();
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);  
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);  
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameterf(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);  
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+    GLint environmentWidth(0);
+    GLint environmentHeight(0);
+    std::vector<float> environment;
+
+    if(environmentPath && !readPFM(environmentPath, environmentWidth, environmentHeight, environment))
+    {
+        std::cerr << "Environment lighting ignored." << std::endl;
+        environmentPath = nullptr;
+    }
+    if(environmentPath)
+    {
+        for(size_t i = 0; i < environment.size(); ++i)
+            environment[i] *= environmentScale;
+
+        std::vector<glm::vec4> table;
+        std::vector<glm::vec4> rows;
+        environmentTables(environmentWidth, environmentHeight, environment, table, rows);
+
+        glActiveTexture(GL_TEXTURE19);
+
+        glGenTextures(1, &environmentImage);
+        glBindTexture(GL_TEXTURE_2D, environmentImage);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, environmentWidth, environmentHeight
+            , 0, GL_RGB, GL_FLOAT, &environment[0]);
+        glError();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+        glActiveTexture(GL_TEXTURE20);
+
+        glGenTextures(1, &environmentTable);
+        glBindTexture(GL_TEXTURE_2D, environmentTable);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, environmentWidth, environmentHeight
+            , 0, GL_RGBA, GL_FLOAT, &table[0]);
+        glError();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+        glActiveTexture(GL_TEXTURE21);
+
+        glGenTextures(1, &environmentRows);
+        glBindTexture(GL_TEXTURE_1D, environmentRows);
+        glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, environmentHeight
+            , 0, GL_RGBA, GL_FLOAT, &rows[0]);
+        glError();
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    }
 
     // START
 
     glActiveTexture(GL_TEXTURE0);
 
+    update(); // specializes the tracer on the scene
+
+    if(!jobs.empty())
+    {
+        writer = std::thread(writeImages);
+        atexit(joinWriter);
+
+        startJob();
+    }
+
 	glutMainLoop();
 
     return 0;
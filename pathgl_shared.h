@@ -0,0 +1,145 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <new>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// layout of the posix shared memory segment the renderer publishes its
+// progressive image to (double buffered, RGBA32F): the renderer always writes
+// the buffer that is not front and flips front afterwards. every buffer has
+// its own sequence which is odd while being written, so a viewer detects torn
+// reads by comparing the sequence before and after reading - the renderer
+// never waits for anyone, and viewers may attach and detach at will.
+
+struct SharedBuffer
+{
+    std::atomic<std::uint32_t> sequence;
+    std::int32_t width;
+    std::int32_t height;
+    std::int32_t frame;
+};
+
+struct SharedFramebuffer
+{
+    char magic[8];
+    std::uint32_t capacity; // pixels per buffer
+
+    std::atomic<std::uint32_t> front; // index of the latest complete buffer
+    std::atomic<std::uint32_t> stale; // set when the renderer drops the segment
+
+    SharedBuffer buffers[2];
+};
+
+static const char sharedMagic[8] = "pathgl1";
+
+// pixel data starts at a cache line boundary after the header
+static const std::size_t sharedHeaderSize((sizeof(SharedFramebuffer) + 63) & ~std::size_t(63));
+
+inline std::size_t sharedSize(const std::uint32_t capacity)
+{
+    return sharedHeaderSize + 2 * static_cast<std::size_t>(capacity) * 4 * sizeof(float);
+}
+
+inline float * sharedPixels(
+    SharedFramebuffer * shared
+,   const std::uint32_t index)
+{
+    return reinterpret_cast<float *>(reinterpret_cast<char *>(shared) + sharedHeaderSize)
+        + static_cast<std::size_t>(index) * shared->capacity * 4;
+}
+
+inline const float * sharedPixels(
+    const SharedFramebuffer * shared
+,   const std::uint32_t index)
+{
+    return sharedPixels(const_cast<SharedFramebuffer *>(shared), index);
+}
+
+#ifndef WIN32
+
+// creates a fresh segment of given capacity (renderer), replacing any
+// existing segment of that name - returns nullptr on failure
+inline SharedFramebuffer * createShared(
+    const char * name
+,   const std::uint32_t capacity)
+{
+    shm_unlink(name);
+
+    const int fd(shm_open(name, O_CREAT | O_RDWR, 0644));
+    if(fd < 0)
+        return nullptr;
+
+    const std::size_t size(sharedSize(capacity));
+    if(ftruncate(fd, static_cast<off_t>(size)) < 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void * memory(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    close(fd);
+
+    if(MAP_FAILED == memory)
+        return nullptr;
+
+    SharedFramebuffer * shared(new (memory) SharedFramebuffer);
+    shared->capacity = capacity;
+    shared->front.store(0);
+    shared->stale.store(0);
+
+    for(int i = 0; i < 2; ++i)
+    {
+        shared->buffers[i].sequence.store(0);
+        shared->buffers[i].width  = 0;
+        shared->buffers[i].height = 0;
+        shared->buffers[i].frame  = -1;
+    }
+    std::memcpy(shared->magic, sharedMagic, sizeof(sharedMagic));
+
+    return shared;
+}
+
+// maps an existing segment read-only (viewer) - returns nullptr if there is
+// none or it is not a pathgl framebuffer
+inline const SharedFramebuffer * attachShared(
+    const char * name
+,   std::size_t & size)
+{
+    const int fd(shm_open(name, O_RDONLY, 0));
+    if(fd < 0)
+        return nullptr;
+
+    struct stat status;
+    if(fstat(fd, &status) < 0 || static_cast<std::size_t>(status.st_size) < sharedHeaderSize)
+    {
+        close(fd);
+        return nullptr;
+    }
+    size = static_cast<std::size_t>(status.st_size);
+
+    void * memory(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+    close(fd);
+
+    if(MAP_FAILED == memory)
+        return nullptr;
+
+    const SharedFramebuffer * shared(static_cast<const SharedFramebuffer *>(memory));
+    if(0 != std::memcmp(shared->magic, sharedMagic, sizeof(sharedMagic)) || size < sharedSize(shared->capacity))
+    {
+        munmap(memory, size);
+        return nullptr;
+    }
+    return shared;
+}
+
+#endif
@@ -0,0 +1,147 @@
+
+#include <GL/freeglut.h>
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
+
+#include "pathgl_shared.h"
+
+// lightweight viewer for the shared memory framebuffer published by
+// "pathgl --shm [name]". The mapping is read-only and the latest front
+// buffer is drawn straight from it, at the viewers own pace. Any number
+// of viewers can attach and detach, the renderer never notices.
+
+const char * name("/pathgl");
+
+const SharedFramebuffer * shared(nullptr);
+std::size_t sharedBytes(0);
+
+// sequence of the buffer shown last, for skipping unchanged frames
+std::uint32_t shown[2] = { 0, 0 };
+std::uint32_t shownFront(-1);
+
+GLint viewport[2] = { 520, 520 };
+
+// milliseconds between polls of the segment
+int interval(16);
+
+
+void detach()
+{
+#ifndef WIN32
+    if(shared)
+        munmap(const_cast<SharedFramebuffer *>(shared), sharedBytes);
+#endif
+    shared = nullptr;
+    shownFront = -1;
+}
+
+// (re)attaches if there is no segment, or the renderer dropped the current one
+bool attach()
+{
+#ifndef WIN32
+    if(shared && shared->stale.load(std::memory_order_acquire))
+        detach();
+    if(!shared)
+        shared = attachShared(name, sharedBytes);
+#endif
+    return nullptr != shared;
+}
+
+// draws the front buffer scaled to the window, the sequence is compared
+// before and after reading - if the renderer wrote it meanwhile the frame
+// is retried on the next poll. Returns true if a new frame was drawn.
+bool draw()
+{
+    const std::uint32_t front(shared->front.load(std::memory_order_acquire));
+    const SharedBuffer & buffer(shared->buffers[front]);
+
+    const std::uint32_t sequence(buffer.sequence.load(std::memory_order_acquire));
+    if(sequence & 1 || (front == shownFront && sequence == shown[front]))
+        return false;
+
+    const GLsizei width (buffer.width);
+    const GLsizei height(buffer.height);
+    const int frame(buffer.frame);
+
+    if(width <= 0 || height <= 0 || static_cast<std::uint32_t>(width * height) > shared->capacity)
+        return false;
+
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    const float zoom(std::min(viewport[0] / static_cast<float>(width), viewport[1] / static_cast<float>(height)));
+    glPixelZoom(zoom, zoom);
+    glRasterPos2i(-1, -1);
+    glDrawPixels(width, height, GL_RGBA, GL_FLOAT, sharedPixels(shared, front));
+
+    glFinish(); // pixels are read until here
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(buffer.sequence.load(std::memory_order_relaxed) != sequence)
+        return false;
+
+    shownFront = front;
+    shown[front] = sequence;
+
+    const std::string title("pathgl viewer - " + std::string(name) + " - " + std::to_string(frame + 1) + " samples");
+    glutSetWindowTitle(title.c_str());
+
+    return true;
+}
+
+void on_display()
+{
+    if(attach() && draw())
+        glutSwapBuffers();
+}
+
+void on_reshape(int w, int h)
+{
+    viewport[0] = w;
+    viewport[1] = h;
+
+    glViewport(0, 0, w, h);
+    shownFront = -1;
+}
+
+void on_keyboard(unsigned char key, int x, int y)
+{
+    if(27 == key) // ESC key
+        exit(0);
+}
+
+void on_timer(int value)
+{
+    glutPostRedisplay();
+    glutTimerFunc(interval, on_timer, value);
+}
+
+// usage: pathgl_viewer [name] [poll interval in ms]
+int main(int argc, char** argv)
+{
+    glutInit(&argc, argv);
+
+    if(argc > 1)
+        name = argv[1];
+    if(argc > 2)
+        interval = atoi(argv[2]);
+
+    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE);
+    glutInitWindowSize(viewport[0], viewport[1]);
+    glutCreateWindow("pathgl viewer");
+
+    glutDisplayFunc (on_display);
+    glutReshapeFunc (on_reshape);
+    glutKeyboardFunc(on_keyboard);
+    glutTimerFunc   (interval, on_timer, 0);
+
+    glClearColor(0.f, 0.f, 0.f, 1.f);
+
+    glutMainLoop();
+
+    detach();
+
+    return 0;
+}
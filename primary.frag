@@ -0,0 +1,23 @@
+#version 150
+
+// stores the first hit of the pixel: its position and the triangle (plus
+// one, zero marks pixels without a hit), see primary.vert
+
+in vec3 v_position;
+
+flat in int v_triangle;
+flat in float v_facing;
+
+out vec4 fragHit;
+
+void main()
+{
+#ifdef BACKFACE_CULLING
+    if(v_facing < EPSILON)
+        discard;
+#else
+    if(abs(v_facing) < EPSILON)
+        discard;
+#endif
+    fragHit = vec4(v_position, float(v_triangle + 1));
+}
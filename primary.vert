@@ -0,0 +1,40 @@
+#version 150
+
+// rasterizes the scene (all triangles, as intersected in intersection()) for
+// the first hits of one view: vertices are fetched from the scene textures
+// by vertex id and projected with the inverse ray basis of the view, so
+// each pixel covers exactly the point its primary ray would hit.
+// Specialized and preceded by the common code as trace.frag.
+
+uniform mat3 projection; // inverse ray basis (see trace.geom and reproject.frag)
+uniform vec3 eye;
+uniform float near;      // in units of the ray basis
+
+uniform vec4 tile;
+uniform vec2 jitter;     // sub-pixel offset in normalized device coordinates
+
+out vec3 v_position;
+
+flat out int v_triangle;
+flat out float v_facing; // orientation towards the eye, as tested in intersection()
+
+void main()
+{
+    v_triangle = gl_VertexID / 3;
+
+    ivec4 ti = ivec4(texelFetch(indices, v_triangle, 0));
+
+    vec3 triangle[3];
+    triangle[0] = texelFetch(vertices, ti[0], 0).xyz;
+    triangle[1] = texelFetch(vertices, ti[1], 0).xyz;
+    triangle[2] = texelFetch(vertices, ti[2], 0).xyz;
+
+    v_position = triangle[gl_VertexID % 3];
+    v_facing = dot(triangle[1] - triangle[0], cross(normalize(v_position - eye), triangle[2] - triangle[0]));
+
+    // the ray of ndc (x, y) hits p at q = projection * (p - eye) = s * (x, y, 1),
+    // depth is 1 - 2 near / s, clipped in front of the near plane
+
+    vec3 q = projection * (v_position - eye);
+    gl_Position = vec4((q.xy - tile.zw * q.z) / tile.xy + jitter * q.z, q.z - 2.0 * near, q.z);
+}
@@ -0,0 +1,74 @@
+#version 150
+
+// carries the accumulation over to a changed camera: the first hit of the 
+// pixel is intersected and projected into the previous view of the layer,
+// whose sums (and moments) are taken if the first hit stored there matches
+// in material, depth and normal - scaled down to the maximum history. Pixels
+// without a match, or whose first hit was not visible before, start from 
+// scratch. The material keeps nearly coplanar surfaces apart (e.g., emitters
+// below the ceiling), the nearest pixel would blend them over several moves.
+// Specialized and preceded by the common code as trace.frag.
+
+uniform sampler2DArray source; // sums (rgb) and sample count (alpha) of the previous view
+uniform sampler2DArray moments;
+uniform sampler2DArray normals; // first hit normal (xyz) and depth (w) of the previous view
+uniform sampler2DArray albedos; // first hit material + 1 (a) of the previous view
+
+uniform mat3 reprojections[16]; // inverse ray basis of the previous views (see trace.geom)
+uniform vec3 previousEyes[16];
+
+uniform vec4 tile;
+uniform vec4 viewport; // traced resolution (xy)
+uniform float history; // samples kept at most
+
+in vec2 v_uv;
+in vec3 v_ray;
+
+flat in vec3 v_eye;
+flat in int v_layer;
+
+out vec4 fragColor;
+out vec4 fragMoment;
+
+void main()
+{
+    fragColor  = vec4(0.0);
+    fragMoment = vec4(0.0);
+
+    vec3 triangle[3];
+    int index;
+    mat3 tangentspace;
+
+    vec3 ray = normalize(v_ray);
+    float t = intersection(v_eye, ray, triangle, index);
+    if(t == INFINITY)
+        return;
+
+    vec3 hit = v_eye + ray * t;
+    vec3 n = normal(triangle, tangentspace);
+
+    // pixel of the hit in the previous view
+
+    vec3 q = reprojections[v_layer] * (hit - previousEyes[v_layer]);
+    if(q.z <= 0.0)
+        return;
+
+    vec2 uv = ((q.xy / q.z - tile.zw) / tile.xy) * 0.5 + 0.5;
+    ivec2 xy = ivec2(floor(uv * viewport.xy));
+    if(any(lessThan(xy, ivec2(0))) || any(greaterThanEqual(xy, ivec2(viewport.xy))))
+        return;
+
+    ivec3 texel = ivec3(xy, v_layer);
+
+    if(texelFetch(albedos, texel, 0).a != float(index + 1))
+        return;
+
+    vec4 previous = texelFetch(normals, texel, 0);
+    if(dot(previous.xyz, n) < 0.9 || abs(previous.w - distance(hit, previousEyes[v_layer])) > 0.02 * previous.w)
+        return;
+
+    float weight = min(1.0, history / max(texelFetch(source, texel, 0).a, 1.0));
+
+    fragColor  = texelFetch(source, texel, 0) * weight;
+    fragMoment = texelFetch(moments, texel, 0) * weight;
+}
@@ -0,0 +1,38 @@
+#version 150
+
+// averages the accumulated sums by their sample count (alpha). Per pixel, the
+// target with more samples is taken: passes dispatched in tiles leave the
+// other target behind only partially.
+// For adaptive sampling, the noise of each pixel is estimated from the second
+// moment of the path luminance as well: the standard error of the mean, 
+// relative to its square root - the error of the gamma 2 encoded value.
+
+uniform sampler2DArray sums[2];
+uniform sampler2DArray moments[2];
+
+const vec3 luma = vec3(0.2126, 0.7152, 0.0722); // as in trace.frag
+
+in vec2 v_uv;
+flat in int v_layer;
+
+out vec4 fragColor;
+out vec4 fragNoise;
+
+void main()
+{
+    ivec3 texel = ivec3(gl_FragCoord.xy, v_layer);
+
+    vec4 a = texelFetch(sums[0], texel, 0);
+    vec4 b = texelFetch(sums[1], texel, 0);
+
+    vec4 sum = a.a >= b.a ? a : b;
+    float moment = a.a >= b.a ? texelFetch(moments[0], texel, 0).r : texelFetch(moments[1], texel, 0).r;
+
+    float n = max(sum.a, 1.0);
+    fragColor = vec4(sum.rgb / n, 1.0);
+
+    float mean = dot(fragColor.rgb, luma);
+    float variance = max(moment / n - mean * mean, 0.0) * n / max(n - 1.0, 1.0);
+
+    fragNoise = vec4(sqrt(variance / n) / max(2.0 * sqrt(mean), 0.1));
+}
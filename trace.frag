@@ -1,212 +1,445 @@
-#version 140
+#version 150
+
+// specialized by the host (see specialize() in pathgl.cpp), which inserts
+// the scene and settings as defines: TRIANGLES, LIGHT_TRIANGLES, BOUNCES, 
+// SAMPLES, and optionally MIN_BOUNCES, BACKFACE_CULLING, ADAPTIVE, FEATURES,
+// PRIMARY_VARIANTS, LIGHT_TREE, RESTIR, ENVIRONMENT, GUIDING, and 
+// RADIANCE_CACHE, followed by the common code (trace.glsl)
 
 precision highp float;
 
-out vec4 gl_FragColor;
+out vec4 fragColor;
 
 uniform int frame;
-uniform int rand;
-uniform float accum;
-uniform vec3 eye;
+uniform int accumulation; // seeds the sample sequences of the pixels
 uniform vec4 viewport;
 
-uniform  sampler2D hsphere;
-uniform  sampler2D lights;
+uniform  sampler2DArray source; // sums (rgb) and sample count (alpha) of previous passes
 
-uniform  sampler1D vertices;
-uniform  sampler1D colors;
-uniform usampler1D indices;
+#ifdef ADAPTIVE
+out vec4 fragMoment;
 
-uniform  sampler2D source;
+uniform sampler2DArray moments; // summed squared path luminance of previous passes
+#endif
 
+const vec3 luma = vec3(0.2126, 0.7152, 0.0722); // as in resolve.frag
 
-in vec2 v_uv;
-in vec3 v_ray;
+#ifdef PRIMARY_VARIANTS // first hits rasterized per view and jitter variant (see primary.frag)
+uniform sampler2DArray primary;
+#endif
 
-const vec3 up = vec3(0.0, 1.0, 0.0);
+#ifdef FEATURES // first hit of the pixel, guiding the denoiser (denoise.frag)
+out vec4 fragAlbedo; // and material + 1 (a), telling surfaces apart for reprojection
+out vec4 fragNormal; // and depth (w)
+#endif
 
-const float EPSILON  = 1e-6;
-const float INFINITY = 1e+4;
+#ifdef RESTIR // reservoirs of the direct lighting at the first hit (see resample())
+out vec4 fragReservoir;
+out vec4 fragReservoirCount;
 
-// intersection with triangle
-bool intersection(
-	const in vec3  triangle[3]
-,	const in vec3  origin
-,	const in vec3  ray
-,	const in float tm
-,   out float t)
-{
-	vec3 e0 = triangle[1] - triangle[0];
-	vec3 e1 = triangle[2] - triangle[0];
+uniform sampler2DArray reservoirs;      // of the previous pass: sample (xyz) and its weight W (w)
+uniform sampler2DArray reservoirCounts; // candidates seen M (x), emitter (y), first hit depth (z) and triangle (w)
 
-	vec3  h = cross(ray, e1);
-	float a = dot(e0, h);
+const int   RESTIR_DIMENSION = BOUNCES * DIMENSIONS; // following those of the paths
+const int   RESTIR_NEIGHBORS = 4;
+const float RESTIR_RADIUS    = 16.0; // of the neighborhood, in pixels
+const float RESTIR_HISTORY   = 20.0; // candidates reused at most, relative to those of a pass
+#endif
 
-	// if(a > -EPSILON && a < EPSILON) // backface culling off
-	if(a < EPSILON) // backface culling on
-		return false;
+in vec2 v_uv;
+in vec3 v_ray;
 
-	float f = 1.0 / a;
+flat in vec3 v_eye;
+flat in int v_layer;
 
-	vec3  s = origin - triangle[0];
-	float u = f * dot(s, h);
+#ifdef RESTIR
 
-	if(u < 0.0 || u > 1.0)
-		return false;
+// a reservoir keeps one of the candidates streamed into it, each with the 
+// probability of its weight relative to the sum of all weights
+struct Reservoir
+{
+	vec3  position; // point on the emitter kept
+	int   emitter;
+	float target;   // its target function
+	float weights;  // sum of the weights streamed
+	float count;    // candidates streamed, M
+};
+
+void stream(
+	inout Reservoir r
+,	const in vec3 position
+,	const in int emitter
+,	const in float target
+,	const in float weight
+,	const in float count
+,	const in float u)
+{
+	r.weights += weight;
+	r.count += count;
 
-	vec3  q = cross(s, e0);
-	float v = f * dot(ray, q);
+	if(u * r.weights < weight)
+	{
+		r.position = position;
+		r.emitter = emitter;
+		r.target = target;
+	}
+}
 
-	if(v < 0.0 || u + v > 1.0)
-		return false;
+// unshadowed contribution of a point on an emitter to the hit, by area - its
+// luminance is the target function of resampling
+vec3 contribution(
+	const in Material m
+,	const in vec3 origin
+,	const in vec3 n
+,	const in vec3 wo
+,	const in vec3 position
+,	const in int emitter)
+{
+	vec3 tv[3];
+	Material e = material(fetch(emitter, tv));
 
-	t = f * dot(e1, q);
+	vec3 light = position - origin;
+	float t = length(light);
+	light /= t;
 
-	if (t < EPSILON)
-		return false;
+	float a = dot(n, light);
+	float al = -dot(normalize(cross(tv[1] - tv[0], tv[2] - tv[0])), light);
+	if(a <= 0.0 || al <= 0.0)
+		return vec3(0.0);
 
-	return (t > 0.0) && (t < tm);
+	return e.emission * brdf(m, n, wo, light) * a * al / (t * t);
 }
 
-// plane intersection
-bool intersectionPlane(
-    const in vec4  plane
-,   const in vec3  origin
-,   const in vec3  ray
-,   const in float tm
-,   out float t)
+// streams a reservoir of the previous pass into r, with its sample weighted 
+// by the target function at this hit
+void reuse(
+	inout Reservoir r
+,	const in ivec3 texel
+,	const in Material m
+,	const in vec3 origin
+,	const in vec3 n
+,	const in vec3 wo
+,	const in float u)
 {
-    t = -(dot(plane.xyz, origin) + plane.w) / dot(plane.xyz, ray);
-    return (t > 0.0) && (t < tm);
+	vec4 kept = texelFetch(reservoirs, texel, 0);
+	vec4 count = texelFetch(reservoirCounts, texel, 0);
+
+	float M = min(count.x, RESTIR_HISTORY * float(RESTIR));
+	float target = dot(contribution(m, origin, n, wo, kept.xyz, int(count.y)), luma);
+
+	stream(r, kept.xyz, int(count.y), target, target * kept.w * M, M, u);
 }
 
-// sphere intersection
-bool intersectionSphere(
-    const in vec4  sphere
-,   const in vec3  origin
-,   const in vec3  ray
-,   const in float tm
-,   out float t)
+// direct lighting at the first hit by resampled importance sampling (ReSTIR,
+// Bitterli et al. 2020): RESTIR candidates of sampleEmitter() are streamed 
+// into a reservoir by their unshadowed contribution, followed by the 
+// reservoirs of the previous pass of this pixel (temporal reuse) and of 
+// neighbors with a similar first hit (spatial reuse). A single shadow ray 
+// tests the sample kept, but the reservoir stays unshadowed: reusing the
+// visibility would count occluded samples in M with zero weight, darkening
+// penumbrae over the accumulation. Returns the contribution of the sample, 
+// weighted by the (1 / M) estimator - biased only where neighbors pass the
+// similarity test but differ in their target function.
+vec3 resample(
+	const in Material m
+,	const in vec3 origin
+,	const in vec3 n
+,	const in vec3 wo
+,	const in int hit
+,	const in float t
+,	const in uint seed
+,	const in int index)
 {
-    bool  r = false;
-    vec3  d = origin - sphere.xyz;  // distance
+	Reservoir r = Reservoir(vec3(0.0), 0, 0.0, 0.0, 0.0);
 
-    float b = dot(ray, d);
-    float c = dot(d, d) - sphere.w * sphere.w;
+	vec3 tv[3];
+	mat3 tangentspace;
 
-    t = b * b - c;
+	for(int i = 0; i < RESTIR; ++i)
+	{
+		vec2 u0 = sample2D(seed, index, RESTIR_DIMENSION + 2 * i);     // emitter, streaming
+		vec2 u1 = sample2D(seed, index, RESTIR_DIMENSION + 2 * i + 1); // point
 
-    if(t > 0.0)
-    {
-        t = -b - sqrt(t);
-        r = (t > 0.0) && (t < tm);
-    }
-    return r;
-}
+		float probability;
+		int emitter = selectEmitter(u0.x, origin, probability);
+		fetch(emitter, tv);
 
-// intersection with scene geometry
-float intersection(
-    const in vec3 origin
-,   const in vec3 ray
-,   out vec3 triangle[3]
-,   out int index)
-{
-    float tm = INFINITY;
-    float t = INFINITY;
+		vec3 position = pointOnTriangle(tv, u1);
+		float pdf = 2.0 * probability / length(cross(tv[1] - tv[0], tv[2] - tv[0]));
+
+		float target = dot(contribution(m, origin, n, wo, position, emitter), luma);
+		stream(r, position, emitter, target, target / pdf, 1.0, u0.y);
+	}
 
-	 vec3 tv[3];
-	 vec4 tc;
-	ivec4 ti;
+	int dimension = RESTIR_DIMENSION + 2 * RESTIR;
+	ivec3 texel = ivec3(gl_FragCoord.xy, v_layer);
 
-	for(int i = 2; i < 34; ++i)
+	reuse(r, texel, m, origin, n, wo, sample2D(seed, index, dimension).x);
+
+	for(int i = 0; i < RESTIR_NEIGHBORS; ++i)
 	{
-		ti = ivec4(texelFetch(indices, i, 0));
+		vec2 u0 = sample2D(seed, index, dimension + 2 * i + 1); // offset
+		vec2 u1 = sample2D(seed, index, dimension + 2 * i + 2); // streaming
 
-		tv[0] = texelFetch(vertices, ti[0], 0).xyz;
-		tv[1] = texelFetch(vertices, ti[1], 0).xyz;
-		tv[2] = texelFetch(vertices, ti[2], 0).xyz;
+		vec2 offset = RESTIR_RADIUS * sqrt(u0.x) * vec2(cos(2.0 * PI * u0.y), sin(2.0 * PI * u0.y));
+		ivec3 neighbor = ivec3(ivec2(gl_FragCoord.xy + offset), v_layer);
 
-		if(intersection( tv, origin, ray, tm, t))
-		{
-			triangle = tv;
-			index = ti[3];
-			tm = t;
-		}
+		if(any(lessThan(neighbor.xy, ivec2(0))) || any(greaterThanEqual(neighbor.xy, ivec2(viewport.xy))))
+			continue;
+
+		vec4 count = texelFetch(reservoirCounts, neighbor, 0);
+		if(count.x == 0.0 || abs(count.z - t) > 0.1 * t)
+			continue;
+
+		fetch(int(count.w), tv);
+		if(dot(normal(tv, tangentspace), n) < 0.9)
+			continue;
+
+		reuse(r, neighbor, m, origin, n, wo, u1.x);
 	}
 
-    return tm;
+	float W = r.target > 0.0 ? r.weights / (r.count * r.target) : 0.0;
+
+	fragReservoir = vec4(r.position, W);
+	fragReservoirCount = vec4(r.count, float(r.emitter), t, float(hit));
+
+	// visibility of the sample kept
+
+	vec3 light = r.position - origin;
+	if(W > 0.0 && occluded(origin, normalize(light), length(light)))
+		return vec3(0.0);
+
+	return contribution(m, origin, n, wo, r.position, r.emitter) * W;
 }
 
-// intersection with scene geometry
-float shadow(
-	const in int fragID
-,	const in ivec2 lightssize
+#endif
+
+#if defined(GUIDING) || defined(RADIANCE_CACHE)
+
+// key of the grid cell containing the position (cells of the given origin and
+// edge length), separated by the dominant axis of the normal - never 0, which
+// marks empty slots of the hash tables
+uint cellKey(
+	const in vec3 position
+,	const in vec3 n
 ,	const in vec3 origin
+,	const in float edge)
+{
+	ivec3 c = clamp(ivec3((position - origin) / edge), ivec3(0), ivec3(511));
+
+	vec3 a = abs(n);
+	int axis = a.x > a.y && a.x > a.z ? 0 : (a.y > a.z ? 2 : 4);
+	axis += (a.x > a.y && a.x > a.z ? n.x : (a.y > a.z ? n.y : n.z)) < 0.0 ? 1 : 0;
+
+	return (uint(c.x) | uint(c.y) << 9u | uint(c.z) << 18u | uint(axis) << 27u) + 1u;
+}
+
+#endif
+
+#ifdef GUIDING // cells of the hash grid, as slots of a table (see guideCell())
+
+// path guiding: directions of bounces are learned per cell of a spatial hash 
+// grid as a histogram over the sphere, trained by the radiance the paths
+// found along them times brdf and cosine, and snapshot by the host every few
+// passes (see guide.comp) as the distribution sampled by the next ones -
+// mixed with brdf sampling by the candidate fraction of the lowest second
+// moment, as estimated from the same paths
+
+layout(std430, binding = 4) buffer GuideKeys     { uint  guideKeys[]; };     // of the cells, 0 for empty slots
+layout(std430, binding = 5) buffer GuideTraining { uint  guideTraining[]; }; // fixed point per bin, sample count and moments per fraction
+layout(std430, binding = 6) buffer GuideLearned  { float guideLearned[]; };  // cumulative distribution per bin, 0 if untrained, and fraction
+
+const int   GUIDE_SIDE      = 8;    // bins of height (y) and angle around it, of equal area
+const int   GUIDE_BINS      = GUIDE_SIDE * GUIDE_SIDE;
+const int   GUIDE_FRACTIONS = 4;    // candidates of the bounces sampled from the guide: 0, 1/4, 2/4, 3/4
+const int   GUIDE_STRIDE    = GUIDE_BINS + 1 + GUIDE_FRACTIONS; // of the training per cell
+const int   GUIDE_TRAINING  = 4;    // one of as many paths trains the guide, the same for all pixels
+const float GUIDE_SCALE     = 16.0; // fixed point of the training
+const float GUIDE_CLAMP     = 64.0; // per sample, against fireflies dominating a cell
+
+// slot of the cell containing the position (see cellKey()) - claimed on 
+// first use, -1 if the probes find none left
+int guideCell(
+	const in vec3 position
 ,	const in vec3 n)
 {
+	uint key = cellKey(position, n, GUIDE_ORIGIN, GUIDE_CELL);
+	uint slot = pcg(key);
 
-    float tm = INFINITY;
-	float t = INFINITY;
+	for(int i = 0; i < 8; ++i, ++slot)
+	{
+		uint k = atomicCompSwap(guideKeys[slot % uint(GUIDING)], 0u, key);
+		if(k == 0u || k == key)
+			return int(slot % uint(GUIDING));
+	}
+	return -1;
+}
 
-	 vec3 tv[3];
-	 vec4 tc;
-	ivec4 ti;
+bool trained(const in int cell)
+{
+	return cell >= 0 && guideLearned[cell * (GUIDE_BINS + 1) + GUIDE_BINS - 1] > 0.0;
+}
 
-	int i = int(mod(fragID, lightssize[0] * lightssize[1]));
+// of the bounces sampled from the guide of a trained cell
+float guideFraction(const in int cell)
+{
+	return guideLearned[cell * (GUIDE_BINS + 1) + GUIDE_BINS];
+}
 
-    int y = int(i / float(lightssize[0]));
-    int x = int(i - y * lightssize[0]);
+int guideBin(const in vec3 wi)
+{
+	int i = min(int((atan(wi.z, wi.x) / (2.0 * PI) + 0.5) * float(GUIDE_SIDE)), GUIDE_SIDE - 1);
+	int j = clamp(int((wi.y * 0.5 + 0.5) * float(GUIDE_SIDE)), 0, GUIDE_SIDE - 1);
 
-	// select random point on hemisphere
-	vec3 ray = normalize(texelFetch(lights, ivec2(x, y), 0).rgb - origin);
+	return j * GUIDE_SIDE + i;
+}
 
-	float a = dot(ray, n);
+// pdf of sampleGuide() for the direction, in solid angle
+float guidePdf(
+	const in int cell
+,	const in vec3 wi)
+{
+	int first = cell * (GUIDE_BINS + 1);
+	int b = first + guideBin(wi);
+	float p = guideLearned[b] - (b > first ? guideLearned[b - 1] : 0.0);
 
-	if(a < EPSILON)
-		return 0.0;
+	return p * float(GUIDE_BINS) / (4.0 * PI);
+}
 
-	for(int i = 4; i < 34; ++i)
+// samples a direction from the learned distribution of a trained cell: the
+// bin by u.x (binary search over the cumulative one), uniformly within by 
+// the fraction of u.x in the bin and u.y
+vec3 sampleGuide(
+	const in int cell
+,	const in vec2 u)
+{
+	int first = cell * (GUIDE_BINS + 1);
+	int lower = 0;
+	int upper = GUIDE_BINS - 1;
+
+	while(lower < upper)
 	{
-		ti = ivec4(texelFetch(indices, i, 0));
+		int middle = (lower + upper) / 2;
+		if(guideLearned[first + middle] > u.x)
+			upper = middle;
+		else
+			lower = middle + 1;
+	}
+	float begin = lower > 0 ? guideLearned[first + lower - 1] : 0.0;
+	float fraction = clamp((u.x - begin) / max(guideLearned[first + lower] - begin, EPSILON), 0.0, 1.0);
 
-		tv[0] = texelFetch(vertices, ti[0], 0).xyz;
-		tv[1] = texelFetch(vertices, ti[1], 0).xyz;
-		tv[2] = texelFetch(vertices, ti[2], 0).xyz;
+	float y = ((float(lower / GUIDE_SIDE) + fraction) / float(GUIDE_SIDE)) * 2.0 - 1.0;
+	float phi = ((float(lower % GUIDE_SIDE) + u.y) / float(GUIDE_SIDE) - 0.5) * 2.0 * PI;
+	float r = sqrt(max(0.0, 1.0 - y * y));
 
-		if(intersection( tv, origin, ray, tm, t))
-			return 0.0;
-	}
-	return a;
+	return vec3(r * cos(phi), y, r * sin(phi));
 }
 
-// retrieve normal of triangle, and provide tangentspace
-vec3 normal(
-	const in vec3 triangle[3]
-,	out mat3 tangentspace)
+// adds the contribution of a sampled direction (radiance times brdf and
+// cosine over the pdf of the mixture) to the training of its bin, and the
+// second moment it implies for each candidate fraction - given the pdfs of
+// the mixture, the brdf and the guide (negative if untrained) - rounded
+// stochastically by u
+void train(
+	const in int cell
+,	const in vec3 wi
+,	const in float contribution
+,	const in vec3 pdfs
+,	const in float u)
 {
-	vec3 e0 = triangle[1] - triangle[0];
-	vec3 e1 = triangle[2] - triangle[0];
+	int t = cell * GUIDE_STRIDE;
+	float c = min(contribution, GUIDE_CLAMP);
+
+	atomicAdd(guideTraining[t + guideBin(wi)], uint(c * GUIDE_SCALE + u));
+	atomicAdd(guideTraining[t + GUIDE_BINS], 1u);
 
-	// hemisphere samplepoints is oriented up
+	if(pdfs.z < 0.0)
+		return;
 
-	tangentspace[0] = normalize(e0);
-	tangentspace[1] = normalize(cross(e0, e1));
-	tangentspace[2] = cross(tangentspace[1], tangentspace[0]);
+	// sampled by the mixture, c^2 times its pdf over the one of another is the
+	// second moment of sampling by the other
+	for(int i = 0; i < GUIDE_FRACTIONS; ++i)
+	{
+		float moment = c * c * pdfs.x / max(mix(pdfs.y, pdfs.z, float(i) / float(GUIDE_FRACTIONS)), EPSILON);
+		atomicAdd(guideTraining[t + GUIDE_BINS + 1 + i], uint(min(moment, GUIDE_CLAMP * GUIDE_CLAMP) * GUIDE_SCALE / GUIDE_CLAMP + u));
+	}
+}
+
+#endif
+
+#ifdef RADIANCE_CACHE // cells of a second hash grid, as slots of a table (see cacheCell())
+
+// radiance cache: the radiance reflected by diffuse surfaces at the vertex
+// CACHE_BOUNCE of paths is averaged per cell of a spatial hash grid and 
+// snapshot by the host before each pass (see cache.comp). Paths end there in
+// trained cells, taking the cached radiance for the rest of the path - the 
+// cell's average as bias for shorter paths. The paths of one in 
+// CACHE_TRAINING blocks of pixels (coherent, thus not stalling those ending 
+// early) ignore the cache and train it, so cells follow changes and keep the
+// bounces left (no feedback of the cache into itself)
+
+layout(std430, binding = 7) buffer CacheKeys     { uint cacheKeys[]; };     // of the cells, 0 for empty slots
+layout(std430, binding = 8) buffer CacheTraining { uint cacheTraining[]; }; // fixed point radiance (rgb) and sample counts per channel
+layout(std430, binding = 9) buffer CacheLearned  { vec4 cacheLearned[]; };  // average radiance (rgb), samples (w) - 0 if untrained
+
+const float CACHE_SCALE = 64.0;  // fixed point of the training radiance
+const float CACHE_CLAMP = 256.0; // per sample, against fireflies dominating a cell
+const uint  CACHE_TRAINING = 8u; // one of as many pixel blocks trains the cache, per path
+const int   CACHE_BLOCK    = 8;  // edge length of the blocks, in pixels
+
+// slot of the cell containing the position (see cellKey()) - claimed on 
+// first use, -1 if the probes find none left
+int cacheCell(
+	const in vec3 position
+,	const in vec3 n)
+{
+	uint key = cellKey(position, n, CACHE_ORIGIN, CACHE_CELL);
+	uint slot = pcg(key);
 
-	return tangentspace[1];
+	for(int i = 0; i < 8; ++i, ++slot)
+	{
+		uint k = atomicCompSwap(cacheKeys[slot % uint(RADIANCE_CACHE)], 0u, key);
+		if(k == 0u || k == key)
+			return int(slot % uint(RADIANCE_CACHE));
+	}
+	return -1;
 }
 
-// select random point on hemisphere
-vec3 random(
-	const in int fragID
-,	const in ivec2 hspheresize)
+// adds the radiance reflected at a vertex to the training of its cell, per
+// channel the throughput reached it with (others are unknown, thus skipped) -
+// rounded stochastically by u
+void store(
+	const in int cell
+,	const in vec3 radiance
+,	const in vec3 throughput
+,	const in float u)
 {
-	int i = int(mod(fragID, hspheresize[0] * hspheresize[1]));
+	int t = cell * 6;
+
+	for(int c = 0; c < 3; ++c)
+		if(throughput[c] > 0.0)
+		{
+			atomicAdd(cacheTraining[t + c], uint(clamp(radiance[c], 0.0, CACHE_CLAMP) * CACHE_SCALE + u));
+			atomicAdd(cacheTraining[t + 3 + c], 1u);
+		}
+}
 
-    int y = int(i / float(hspheresize[0]));
-    int x = int(i - y * hspheresize[0]);
+#endif
 
-	return texelFetch(hsphere, ivec2(x, y), 0).rgb;
+// pdf of the next direction as sampled in main(): by the brdf, mixed with the
+// guide of the cell if trained
+float directionPdf(
+	const in Material m
+,	const in vec3 n
+,	const in vec3 wo
+,	const in vec3 wi
+,	const in int cell)
+{
+#ifdef GUIDING
+	if(trained(cell) && guideFraction(cell) > 0.0)
+		return mix(brdfPdf(m, n, wo, wi), guidePdf(cell, wi), guideFraction(cell));
+#endif
+	return brdfPdf(m, n, wo, wi);
 }
 
 // http://gpupathtracer.blogspot.de/
@@ -218,52 +451,282 @@ vec3 random(
 
 void main()
 {
-    vec3 origin = eye;
-    vec3 ray = normalize(v_ray);
-	vec3 n;
-	mat3 tangentspace;
-
-	// fragment index for random variation
-	
-	ivec2 hspheresize = textureSize(hsphere, 0);
-	ivec2 lightssize = textureSize(lights, 0);
-
-	vec2 xy = v_uv * vec2(viewport[0], viewport[1]);
-	int fragID = int(xy.y * viewport[0] + xy.x + frame + rand);
+	// sample sequence of the pixel, its paths are indexed over all passes
 
+	ivec2 xy = ivec2(gl_FragCoord.xy);
+	uint pixelSeed = scramble((v_layer * int(viewport[1]) + xy.y) * int(viewport[0]) + xy.x, accumulation);
 
 	// triangle data
     vec3 triangle[3];
     vec3 color;
     int index;
+    int hit;
 
-	// path color accumulation
-	vec3 maskColor = vec3(1.0);
-	vec3 pathColor = vec3(0.0);
+	vec3 n;
+	mat3 tangentspace;
+
+	// summed color of all paths of this pass
+	vec3 sampleColor = vec3(0.0);
+	float sampleMoment = 0.0;
 
-	float t = INFINITY;
+#ifdef RESTIR // resampled once per pass, for the first hit shared by all paths
+	vec3 direct = vec3(0.0);
 
-	for(int bounce = 0; bounce < 4; ++bounce)
+	fragReservoir = vec4(0.0);
+	fragReservoirCount = vec4(0.0);
+#endif
+
+#ifdef FEATURES
+	fragAlbedo = vec4(0.0);
+	fragNormal = vec4(0.0);
+#endif
+
+	for(int k = 0; k < SAMPLES; ++k)
 	{
-  		t = intersection(origin, ray, triangle, index); // compute t from objects
+		vec3 origin = v_eye;
+		vec3 ray = normalize(v_ray);
+
+		int sampleIndex = frame * SAMPLES + k;
 
-		// TODO: break on no intersection, with correct path color weight?
-		if(t == INFINITY)
-			break;
+		// path color accumulation
+		vec3 maskColor = vec3(1.0);
+		vec3 pathColor = vec3(0.0);
 
-		origin = origin + ray * t;
-		n = normal(triangle, tangentspace);
+		float t = INFINITY;
+		float pdf = 0.0; // of the brdf sampled direction of the ray, 0 for the primary ray
 
-  		vec3 color = texelFetch(colors, index, 0).xyz; // compute material color from hit
-  		float lighting = shadow(fragID + bounce, lightssize, origin, n) * 0.4; // compute direct lighting from hit
+#ifdef GUIDING // vertices of training paths, trained once the path is complete
+		bool learning = 0 == sampleIndex % GUIDE_TRAINING;
 
-  		// accumulate incoming light
+		int   cells[BOUNCES];
+		vec3  rays[BOUNCES];
+		vec3  pdfs[BOUNCES];   // of the mixture, the brdf and the guide (see train())
+		vec3  masks[BOUNCES];  // throughput reaching the vertex
+		vec3  colors[BOUNCES]; // path color before the bounce
+		int   vertices = 0;
+		float guided = 1.0;    // throughput over the one of brdf sampling
+#endif
 
-  		maskColor *= color;
-  		pathColor += maskColor * lighting;
+#ifdef RADIANCE_CACHE // vertex at CACHE_BOUNCE of training paths, trained once it is complete
+		ivec2 block = xy / CACHE_BLOCK;
+		bool training = 0u == pcg(uint((v_layer * 4096 + block.y) * 4096 + block.x) ^ pcg(uint(sampleIndex + accumulation))) % CACHE_TRAINING;
 
-  		ray = tangentspace * random(fragID + bounce, hspheresize); // compute next ray
+		int   slot = -1;
+		vec3  arrival;   // throughput reaching the vertex
+		vec3  reflected; // path color up to its emission
+#endif
+
+#ifdef PRIMARY_VARIANTS
+		// samples cycle through the jittered variants
+		vec4 first = texelFetch(primary, ivec3(gl_FragCoord.xy, v_layer * PRIMARY_VARIANTS + sampleIndex % PRIMARY_VARIANTS), 0);
+#endif
+
+		for(int bounce = 0; bounce < BOUNCES; ++bounce)
+		{
+#ifdef PRIMARY_VARIANTS
+			if(0 == bounce) // ray towards the cached first hit, intersected with its triangle only
+			{
+				t = INFINITY;
+				if(first.w > 0.0)
+				{
+					hit = int(first.w) - 1;
+					index = fetch(hit, triangle);
+					ray = normalize(first.xyz - origin);
+
+					if(!intersection(triangle, origin, ray, INFINITY, t))
+						t = distance(first.xyz, origin);
+				}
+			}
+			else
+#endif
+			{
+  				t = intersection(origin, ray, hit); // compute t from objects
+				if(t < INFINITY)
+					index = fetch(hit, triangle);
+			}
+
+			// escaping rays end in the environment, weighted against sampling it at
+			// the previous hit as emitters are
+			if(t == INFINITY)
+			{
+#ifdef ENVIRONMENT
+				pathColor += maskColor * environmentRadiance(ray) * (0 == bounce ? 1.0 : powerHeuristic(pdf, environmentPdf(ray)));
+#endif
+#ifdef GUIDING
+				if(bounce > 0 && vertices == bounce) // sampled directly, the guide learns reflected light only
+					colors[bounce - 1] = pathColor;
+#endif
+				break;
+			}
+
+			origin = origin + ray * t;
+			n = normal(triangle, tangentspace);
+
+  			Material m = material(index); // compute material from hit
+			vec3 wo = -ray;
+
+			int cell = -1;
+#ifdef GUIDING
+			cell = guideCell(origin, n);
+#endif
+#ifdef FEATURES
+			if(0 == bounce && 0 == k)
+			{
+				fragAlbedo = vec4(m.diffuse + m.specular, float(index + 1));
+				fragNormal = vec4(n, t);
+			}
+#endif
+  			// accumulate emitted and incoming light (paths ended by roulette skip the shadow ray).
+			// Emitters hit by a sampled direction are weighted against sampling the
+			// emitter at the previous hit - multiple importance sampling by the power 
+			// heuristic over both solid angle pdfs
+
+			float cosine = dot(n, wo);
+#ifdef RESTIR
+			if(1 == bounce) // covered by the resampled direct lighting
+				cosine = 0.0;
+#endif
+			if(hit < LIGHT_TRIANGLES && cosine > 0.0)
+				pathColor += maskColor * m.emission * (0 == bounce ? 1.0 : powerHeuristic(pdf, solidAngle(emitterPdf(hit, triangle, origin - ray * t), t, cosine)));
+#ifdef GUIDING
+			if(bounce > 0 && vertices == bounce) // likewise
+				colors[bounce - 1] = pathColor;
+#endif
+
+#ifdef RADIANCE_CACHE
+			// the radiance reflected by diffuse vertices is independent of the 
+			// view: at CACHE_BOUNCE the path ends in the cache if trained
+			if(CACHE_BOUNCE == bounce && m.specular == vec3(0.0))
+			{
+				slot = cacheCell(origin, n);
+				if(!training && slot >= 0 && cacheLearned[slot].w > 0.0)
+				{
+					pathColor += maskColor * cacheLearned[slot].rgb;
+					break;
+				}
+				arrival = maskColor;
+				reflected = pathColor;
+			}
+#endif
+
+			vec2 u = sample2D(pixelSeed, sampleIndex, bounce * DIMENSIONS + DIMENSION_ROULETTE);
+#ifdef MIN_BOUNCES
+			// russian roulette: beyond the minimum path length, paths continue 
+			// with the probability of their throughput times albedo and are 
+			// weighted by its inverse, paths without throughput end in any case
+			vec3 albedo = maskColor * (m.diffuse + m.specular);
+#ifdef GUIDING
+			albedo *= guided; // as if brdf sampled, not ending bounces guided towards bright directions
+#endif
+			float survival = bounce < MIN_BOUNCES ? 1.0 : min(max(albedo.r, max(albedo.g, albedo.b)), 1.0);
+			if(albedo == vec3(0.0) || u.y >= survival)
+				break;
+			maskColor /= survival;
+#endif
+			// direct lighting: a point on the emitters, weighted against brdf sampling
+			// unless the path ends here
+#ifdef RESTIR
+			if(0 == bounce)
+			{
+				if(0 == k)
+					direct = resample(m, origin, n, wo, hit, t, pixelSeed, frame * SAMPLES);
+				pathColor += maskColor * direct;
+			}
+			else
+			{
+#endif
+			vec3 position;
+			vec3 ln;
+			float pl;
+			Material e = material(sampleEmitter(vec3(u.x, sample2D(pixelSeed, sampleIndex, bounce * DIMENSIONS + DIMENSION_LIGHT)), origin, position, ln, pl));
+
+			vec3 light = position - origin;
+			float tl = length(light);
+			light /= tl;
+
+			float a = dot(n, light);
+			float al = -dot(ln, light);
+			if(a >= EPSILON && al >= EPSILON && !occluded(origin, light, tl))
+			{
+				pl = solidAngle(pl, tl, al);
+				pathColor += maskColor * e.emission * brdf(m, n, wo, light) * a / pl * (bounce + 1 < BOUNCES ? powerHeuristic(pl, directionPdf(m, n, wo, light, cell)) : 1.0);
+			}
+#ifdef RESTIR
+			}
+#endif
+#ifdef ENVIRONMENT
+			// and a direction towards the environment, likewise
+			vec3 sky;
+			float pe;
+			vec3 radiance = sampleEnvironment(sample2D(pixelSeed, sampleIndex, bounce * DIMENSIONS + DIMENSION_ENVIRONMENT), sky, pe);
+
+			float ae = dot(n, sky);
+			if(pe > 0.0 && ae >= EPSILON && escapes(origin, sky))
+				pathColor += maskColor * radiance * brdf(m, n, wo, sky) * ae / pe * (bounce + 1 < BOUNCES ? powerHeuristic(pe, directionPdf(m, n, wo, sky, cell)) : 1.0);
+#endif
+
+			// compute next ray by the brdf, weighted by brdf and cosine over its pdf
+			// (with guiding, the one of either technique - one-sample mixture)
+#ifdef GUIDING
+			vec3 arriving = maskColor;
+			vec2 techniques = vec2(0.0, -1.0); // pdfs of brdf and guide
+			if(trained(cell))
+			{
+				// the technique splits the direction sample, so that the samples
+				// of either stay stratified
+				vec2 ud = sample2D(pixelSeed, sampleIndex, bounce * DIMENSIONS + DIMENSION_DIRECTION);
+				float fraction = guideFraction(cell);
+				if(ud.x < fraction)
+					ray = sampleGuide(cell, vec2(ud.x / fraction, ud.y));
+				else
+					sampleBrdf(m, n, tangentspace, wo, vec2((ud.x - fraction) / (1.0 - fraction), ud.y), ray, pdf);
+
+				techniques = vec2(brdfPdf(m, n, wo, ray), guidePdf(cell, ray));
+				pdf = mix(techniques.x, techniques.y, fraction);
+				guided *= pdf / max(techniques.x, EPSILON);
+				maskColor *= dot(n, ray) > 0.0 && pdf > 0.0 ? brdf(m, n, wo, ray) * dot(n, ray) / pdf : vec3(0.0);
+			}
+			else
+#endif
+  			maskColor *= sampleBrdf(m, n, tangentspace, wo, sample2D(pixelSeed, sampleIndex, bounce * DIMENSIONS + DIMENSION_DIRECTION), ray, pdf);
+			if(maskColor == vec3(0.0))
+				break;
+#ifdef GUIDING
+			if(learning && bounce + 1 < BOUNCES) // the last ray is not traced
+			{
+				cells[bounce]  = cell;
+				rays[bounce]   = ray;
+				pdfs[bounce]   = vec3(pdf, techniques);
+				masks[bounce]  = arriving;
+				colors[bounce] = pathColor;
+				vertices = bounce + 1;
+			}
+#endif
+		}
+#ifdef GUIDING
+		// the contribution of the bounce of a vertex is the color added beyond
+		// it, over the throughput reaching the vertex
+		for(int b = 0; b < vertices; ++b)
+			if(cells[b] >= 0)
+				train(cells[b], rays[b], max(dot(pathColor - colors[b], luma) / max(dot(masks[b], luma), EPSILON), 0.0), pdfs[b]
+					, float(pcg(pixelSeed ^ uint(sampleIndex * BOUNCES + b))) / 4294967296.0);
+#endif
+#ifdef RADIANCE_CACHE
+		// the radiance reflected at the vertex is the color added beyond its
+		// emission, over the throughput reaching it (untrained cells are 
+		// trained by any path reaching them)
+		if(slot >= 0 && (training || cacheLearned[slot].w == 0.0))
+			store(slot, (pathColor - reflected) / max(arrival, vec3(EPSILON)), arrival
+				, float(pcg(pixelSeed ^ uint(sampleIndex))) / 4294967296.0);
+#endif
+		sampleColor += pathColor;
+#ifdef ADAPTIVE
+		sampleMoment += dot(pathColor, luma) * dot(pathColor, luma);
+#endif
 	}
    
-    gl_FragColor = vec4(mix(pathColor, texture(source, v_uv).rgb, accum), 1.0);
-}
\ No newline at end of file
+    fragColor = texelFetch(source, ivec3(gl_FragCoord.xy, v_layer), 0) + vec4(sampleColor, float(SAMPLES));
+#ifdef ADAPTIVE
+    fragMoment = texelFetch(moments, ivec3(gl_FragCoord.xy, v_layer), 0) + vec4(sampleMoment);
+#endif
+}
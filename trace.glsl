@@ -0,0 +1,667 @@
+// common code of fragment (megakernel) and compute (wavefront) tracer, 
+// inserted by the host after the version directive and defines
+
+uniform  sampler1D vertices;
+uniform  sampler1D materials; // three texels per material, see material()
+uniform usampler1D indices;
+uniform  sampler1D emitters;  // alias table, see selectEmitter()
+#ifdef LIGHT_TREE
+uniform  sampler1D lightTree; // two texels per node, see importance()
+#endif
+#ifdef ENVIRONMENT
+uniform  sampler2D environment;      // equirectangular radiance, y up
+uniform  sampler2D environmentTable; // alias table per row, see sampleEnvironment()
+uniform  sampler1D environmentRows;
+#endif
+
+const vec3 up = vec3(0.0, 1.0, 0.0);
+
+const float EPSILON  = 1e-6;
+const float SHADOW_OFFSET = 1e-4; // of shadow rays before their target, relative to its distance
+const float INFINITY = 1e+4;
+const float PI       = 3.14159265359;
+
+// intersection with triangle
+bool intersection(
+	const in vec3  triangle[3]
+,	const in vec3  origin
+,	const in vec3  ray
+,	const in float tm
+,   out float t)
+{
+	vec3 e0 = triangle[1] - triangle[0];
+	vec3 e1 = triangle[2] - triangle[0];
+
+	vec3  h = cross(ray, e1);
+	float a = dot(e0, h);
+
+#ifdef BACKFACE_CULLING
+	if(a < EPSILON)
+		return false;
+#else
+	if(a > -EPSILON && a < EPSILON)
+		return false;
+#endif
+
+	float f = 1.0 / a;
+
+	vec3  s = origin - triangle[0];
+	float u = f * dot(s, h);
+
+	if(u < 0.0 || u > 1.0)
+		return false;
+
+	vec3  q = cross(s, e0);
+	float v = f * dot(ray, q);
+
+	if(v < 0.0 || u + v > 1.0)
+		return false;
+
+	t = f * dot(e1, q);
+
+	if (t < EPSILON)
+		return false;
+
+	return (t > 0.0) && (t < tm);
+}
+
+// plane intersection
+bool intersectionPlane(
+    const in vec4  plane
+,   const in vec3  origin
+,   const in vec3  ray
+,   const in float tm
+,   out float t)
+{
+    t = -(dot(plane.xyz, origin) + plane.w) / dot(plane.xyz, ray);
+    return (t > 0.0) && (t < tm);
+}
+
+// sphere intersection
+bool intersectionSphere(
+    const in vec4  sphere
+,   const in vec3  origin
+,   const in vec3  ray
+,   const in float tm
+,   out float t)
+{
+    bool  r = false;
+    vec3  d = origin - sphere.xyz;  // distance
+
+    float b = dot(ray, d);
+    float c = dot(d, d) - sphere.w * sphere.w;
+
+    t = b * b - c;
+
+    if(t > 0.0)
+    {
+        t = -b - sqrt(t);
+        r = (t > 0.0) && (t < tm);
+    }
+    return r;
+}
+
+// fetches the vertices of the given triangle, returns its material index
+int fetch(
+	const in int hit
+,	out vec3 triangle[3])
+{
+	ivec4 ti = ivec4(texelFetch(indices, hit, 0));
+
+	triangle[0] = texelFetch(vertices, ti[0], 0).xyz;
+	triangle[1] = texelFetch(vertices, ti[1], 0).xyz;
+	triangle[2] = texelFetch(vertices, ti[2], 0).xyz;
+
+	return ti[3];
+}
+
+// intersection with scene geometry (emitters included), provides the triangle hit
+float intersection(
+    const in vec3 origin
+,   const in vec3 ray
+,   out int hit)
+{
+    float tm = INFINITY;
+    float t = INFINITY;
+
+	 vec3 tv[3];
+
+	for(int i = 0; i < TRIANGLES; ++i)
+	{
+		fetch(i, tv);
+
+		if(intersection( tv, origin, ray, tm, t))
+		{
+			hit = i;
+			tm = t;
+		}
+	}
+
+    return tm;
+}
+
+// intersection with scene geometry
+float intersection(
+    const in vec3 origin
+,   const in vec3 ray
+,   out vec3 triangle[3]
+,   out int index)
+{
+	int hit;
+	float tm = intersection(origin, ray, hit);
+
+	if(tm < INFINITY)
+		index = fetch(hit, triangle);
+
+    return tm;
+}
+
+#ifdef LIGHT_TREE
+
+// importance of the emitters below a node of the light tree (a binary heap 
+// with the emitters as leaves, LIGHT_TREE levels deep) as seen from origin: 
+// their power over the squared distance to the center of their bounds, not 
+// closer than the bounds radius. Nodes hold bounds min and power, bounds max.
+float importance(
+	const in int node
+,	const in vec3 origin)
+{
+	vec4 a = texelFetch(lightTree, 2 * node, 0);
+	vec3 b = texelFetch(lightTree, 2 * node + 1, 0).xyz;
+
+	vec3 d = 0.5 * (a.xyz + b) - origin;
+
+	return a.w / max(max(dot(d, d), 0.25 * dot(b - a.xyz, b - a.xyz)), EPSILON);
+}
+
+// probability of descending to the right child of a node
+float right(
+	const in int node
+,	const in vec3 origin)
+{
+	float l = importance(2 * node, origin);
+	float r = importance(2 * node + 1, origin);
+
+	return l + r > 0.0 ? r / (l + r) : 0.5;
+}
+
+// selects an emitter by traversing the light tree, u is rescaled per level
+int selectEmitter(
+	float u
+,	const in vec3 origin
+,	out float probability)
+{
+	int node = 1;
+	probability = 1.0;
+
+	for(int level = 0; level < LIGHT_TREE; ++level)
+	{
+		float p = right(node, origin);
+		if(u < p)
+		{
+			node = 2 * node + 1;
+			u /= p;
+			probability *= p;
+		}
+		else
+		{
+			node = 2 * node;
+			u = (u - p) / (1.0 - p);
+			probability *= 1.0 - p;
+		}
+	}
+	return node - (1 << LIGHT_TREE);
+}
+
+// probability of selectEmitter() for the emitter, its path is given by its bits
+float emitterProbability(
+	const in int emitter
+,	const in vec3 origin)
+{
+	int node = 1;
+	float probability = 1.0;
+
+	for(int level = LIGHT_TREE - 1; level >= 0; --level)
+	{
+		float p = right(node, origin);
+		if(((emitter >> level) & 1) == 1)
+		{
+			node = 2 * node + 1;
+			probability *= p;
+		}
+		else
+		{
+			node = 2 * node;
+			probability *= 1.0 - p;
+		}
+	}
+	return probability;
+}
+
+#else
+
+// selects an emitter proportional to its power from the alias table in 
+// constant time: u picks a column, its fraction the emitter or its alias. 
+// Texels hold the probability of the column keeping its emitter (x), the
+// alias (y), and the selection probability of the emitter itself (z).
+int selectEmitter(
+	const in float u
+,	const in vec3 origin
+,	out float probability)
+{
+	float x = u * float(LIGHT_TRIANGLES);
+	int i = min(int(x), LIGHT_TRIANGLES - 1);
+
+	vec2 column = texelFetch(emitters, i, 0).xy;
+	if(x - float(i) >= column.x)
+		i = int(column.y);
+
+	probability = texelFetch(emitters, i, 0).z;
+	return i;
+}
+
+// probability of selectEmitter() for the emitter
+float emitterProbability(
+	const in int emitter
+,	const in vec3 origin)
+{
+	return texelFetch(emitters, emitter, 0).z;
+}
+
+#endif
+
+// uniformly distributed point on the triangle
+vec3 pointOnTriangle(
+	const in vec3 triangle[3]
+,	const in vec2 u)
+{
+	float s = sqrt(u.x);
+	return triangle[0] * (1.0 - s) + triangle[1] * (s * (1.0 - u.y)) + triangle[2] * (s * u.y);
+}
+
+// samples a point on the emitters (the first LIGHT_TRIANGLES): the triangle
+// by u.x as seen from origin, the point uniformly by u.yz. Provides position,
+// normal, and the pdf by area, returns the material of the emitter.
+int sampleEmitter(
+	const in vec3 u
+,	const in vec3 origin
+,	out vec3 position
+,	out vec3 n
+,	out float pdf)
+{
+	vec3 tv[3];
+
+	float probability;
+	int index = fetch(selectEmitter(u.x, origin, probability), tv);
+
+	position = pointOnTriangle(tv, u.yz);
+
+	n = cross(tv[1] - tv[0], tv[2] - tv[0]);
+	pdf = 2.0 * probability / length(n);
+	n = normalize(n);
+
+	return index;
+}
+
+// pdf by area of sampleEmitter() for a point on the emitter (hit triangle)
+float emitterPdf(
+	const in int hit
+,	const in vec3 triangle[3]
+,	const in vec3 origin)
+{
+	return 2.0 * emitterProbability(hit, origin) / length(cross(triangle[1] - triangle[0], triangle[2] - triangle[0]));
+}
+
+// converts a pdf by area into one by solid angle, for a point at the distance
+// and cosine to its normal
+float solidAngle(
+	const in float pdf
+,	const in float t
+,	const in float cosine)
+{
+	return pdf * t * t / cosine;
+}
+
+// weight of a sample by the power heuristic, over the pdf of the other technique
+float powerHeuristic(
+	const in float pdf
+,	const in float other)
+{
+	return pdf * pdf / (pdf * pdf + other * other);
+}
+
+// intersection of shadow ray with scene geometry closer than tm, the distance
+// of the sampled point - shortened slightly, so that the emitter of the point
+// does not occlude it (other emitters do, as for brdf sampled rays)
+bool occluded(
+	const in vec3 origin
+,	const in vec3 ray
+,	float tm)
+{
+	float t = INFINITY;
+	tm *= 1.0 - SHADOW_OFFSET;
+
+	 vec3 tv[3];
+
+	for(int i = 0; i < TRIANGLES; ++i)
+	{
+		fetch(i, tv);
+
+		if(intersection( tv, origin, ray, tm, t))
+			return true;
+	}
+	return false;
+}
+
+#ifdef ENVIRONMENT
+
+// texel of the environment in the direction: longitude around y (u) and 
+// latitude from its bottom (v), rows are stored from the bottom as well
+ivec2 environmentTexel(const in vec3 ray)
+{
+	ivec2 size = textureSize(environment, 0);
+	vec2 uv = vec2(atan(ray.z, ray.x) / (2.0 * PI) + 0.5, 1.0 - acos(clamp(ray.y, -1.0, 1.0)) / PI);
+
+	return min(ivec2(uv * vec2(size)), size - 1);
+}
+
+vec3 environmentRadiance(const in vec3 ray)
+{
+	return texelFetch(environment, environmentTexel(ray), 0).rgb;
+}
+
+// pdf of sampleEnvironment() for the direction, in solid angle: the texel's
+// probability over its solid angle (2 pi / width * pi / height * sin theta)
+float environmentPdf(const in vec3 ray)
+{
+	ivec2 size = textureSize(environment, 0);
+	float sine = sqrt(max(0.0, 1.0 - ray.y * ray.y));
+
+	if(sine <= 0.0)
+		return 0.0;
+
+	return texelFetch(environmentTable, environmentTexel(ray), 0).z * float(size.x * size.y) / (2.0 * PI * PI * sine);
+}
+
+// column i of an alias table or its alias, as in selectEmitter(), by the 
+// fraction x - rescaled to [0, 1) for reuse within the texel selected
+int selectAlias(
+	const in vec2 column
+,	const in int i
+,	inout float x)
+{
+	if(x < column.x)
+	{
+		x /= column.x;
+		return i;
+	}
+	x = (x - column.x) / (1.0 - column.x);
+	return int(column.y);
+}
+
+// samples a direction towards the environment proportional to the luminance
+// times the sine of the polar angle of its texels: the row from the alias 
+// table of the rows by u.y, the texel from the alias table of that row by 
+// u.x, and the direction uniformly within the texel by the remaining 
+// fractions. Provides direction and pdf in solid angle, returns the radiance.
+vec3 sampleEnvironment(
+	vec2 u
+,	out vec3 ray
+,	out float pdf)
+{
+	ivec2 size = textureSize(environment, 0);
+
+	u *= vec2(size);
+	ivec2 texel = min(ivec2(u), size - 1);
+	u -= vec2(texel);
+
+	texel.y = selectAlias(texelFetch(environmentRows, texel.y, 0).xy, texel.y, u.y);
+	texel.x = selectAlias(texelFetch(environmentTable, texel, 0).xy, texel.x, u.x);
+
+	vec2 uv = (vec2(texel) + u) / vec2(size);
+	float phi = (uv.x - 0.5) * 2.0 * PI;
+	float theta = (1.0 - uv.y) * PI;
+
+	ray = vec3(cos(phi) * sin(theta), cos(theta), sin(phi) * sin(theta));
+	pdf = sin(theta) > 0.0 ? texelFetch(environmentTable, texel, 0).z * float(size.x * size.y) / (2.0 * PI * PI * sin(theta)) : 0.0;
+
+	return texelFetch(environment, texel, 0).rgb;
+}
+
+// whether a shadow ray escapes the scene (emitters included) to the environment
+bool escapes(
+	const in vec3 origin
+,	const in vec3 ray)
+{
+	float t = INFINITY;
+
+	 vec3 tv[3];
+
+	for(int i = 0; i < TRIANGLES; ++i)
+	{
+		fetch(i, tv);
+
+		if(intersection( tv, origin, ray, INFINITY, t))
+			return false;
+	}
+	return true;
+}
+
+#endif
+
+// retrieve normal of triangle, and provide tangentspace
+vec3 normal(
+	const in vec3 triangle[3]
+,	out mat3 tangentspace)
+{
+	vec3 e0 = triangle[1] - triangle[0];
+	vec3 e1 = triangle[2] - triangle[0];
+
+	// hemisphere samplepoints is oriented up
+
+	tangentspace[0] = normalize(e0);
+	tangentspace[1] = normalize(cross(e0, e1));
+	tangentspace[2] = cross(tangentspace[1], tangentspace[0]);
+
+	return tangentspace[1];
+}
+
+// pcg hash (Jarzynski and Olano 2020)
+uint pcg(const in uint v)
+{
+	uint state = v * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// sample sequence seed of a pixel (including its layer) in the accumulation
+uint scramble(
+	const in int pixel
+,	const in int accumulation)
+{
+	return pcg(uint(pixel) + pcg(uint(accumulation)));
+}
+
+uint reverseBits(uint v)
+{
+	v = ((v >> 1u) & 0x55555555u) | ((v & 0x55555555u) << 1u);
+	v = ((v >> 2u) & 0x33333333u) | ((v & 0x33333333u) << 2u);
+	v = ((v >> 4u) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4u);
+	v = ((v >> 8u) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8u);
+	return (v >> 16u) | (v << 16u);
+}
+
+// nested uniform (owen) scramble of the bits, from the most significant one
+// down, by a laine-karras style hash (Burley 2020, with Vegdahl's constants)
+uint owen(
+	uint v
+,	const in uint seed)
+{
+	v = reverseBits(v);
+	v ^= v * 0x3d20adeau;
+	v += seed;
+	v *= (seed >> 16u) | 1u;
+	v ^= v * 0x05526c56u;
+	v ^= v * 0x53a22864u;
+	return reverseBits(v);
+}
+
+// first two dimensions of the sobol sequence: van der corput and its (0, 2)
+// partner, whose direction numbers follow from v ^= v >> 1
+uvec2 sobol(uint index)
+{
+	uvec2 x = uvec2(0u);
+	uint v = 0x80000000u;
+
+	for(uint bit = 0u; index != 0u; ++bit, index >>= 1u, v ^= v >> 1u)
+		if((index & 1u) != 0u)
+			x ^= uvec2(0x80000000u >> bit, v);
+
+	return x;
+}
+
+// sample of a dimension pair for the index-th path of a pixel: shuffled and
+// owen scrambled sobol points (Burley 2020), seeded per pixel and dimension
+// so that neither pixels nor dimensions correlate, while each one is
+// stratified over the paths accumulated
+vec2 sample2D(
+	const in uint scramble
+,	const in int index
+,	const in int dimension)
+{
+	uint seed = pcg(scramble + pcg(uint(dimension)));
+	uvec2 x = sobol(owen(uint(index), seed));
+
+	x = uvec2(owen(x.x, pcg(seed ^ 0xa511e9b3u)), owen(x.y, pcg(seed ^ 0x63d83595u)));
+
+	return vec2(x >> 8u) * (1.0 / 16777216.0);
+}
+
+// dimension pairs of a bounce: point on the emitter, emitter selection and
+// russian roulette, the next ray (lobe selection and direction), the 
+// direction towards the environment, and guide or brdf sampling with the 
+// direction from the guide
+const int DIMENSION_LIGHT       = 0;
+const int DIMENSION_ROULETTE    = 1;
+const int DIMENSION_DIRECTION   = 2;
+const int DIMENSION_ENVIRONMENT = 3;
+const int DIMENSION_GUIDE       = 4;
+const int DIMENSIONS            = 5;
+
+// direction on the hemisphere around up (y), cosine distributed
+vec3 cosineHemisphere(const in vec2 u)
+{
+	float r = sqrt(u.x);
+	float phi = 2.0 * PI * u.y;
+
+	return vec3(r * cos(phi), sqrt(max(0.0, 1.0 - u.x)), r * sin(phi));
+}
+
+// orthonormal basis with the given axis as y (Duff et al. 2017)
+mat3 basis(const in vec3 y)
+{
+	float s = y.z >= 0.0 ? 1.0 : -1.0;
+	float a = -1.0 / (s + y.z);
+	float b = y.x * y.y * a;
+
+	return mat3(vec3(1.0 + s * y.x * y.x * a, s * b, -s * y.x), y, vec3(b, s + y.y * y.y * a, -y.y));
+}
+
+// material of a triangle: diffuse albedo, emission, and specular albedo with
+// phong exponent (alpha) - one texel each, see main() in pathgl.cpp
+struct Material
+{
+	vec3 diffuse;
+	vec3 emission;
+	vec3 specular;
+	float exponent;
+};
+
+Material material(const in int index)
+{
+	vec4 specular = texelFetch(materials, index * 3 + 2, 0);
+	return Material(texelFetch(materials, index * 3, 0).rgb, texelFetch(materials, index * 3 + 1, 0).rgb, specular.rgb, specular.a);
+}
+
+// probability of sampling the phong lobe instead of the diffuse one
+float specularProbability(const in Material m)
+{
+	float d = m.diffuse.r + m.diffuse.g + m.diffuse.b;
+	float s = m.specular.r + m.specular.g + m.specular.b;
+
+	return s > 0.0 ? s / (d + s) : 0.0;
+}
+
+// modified phong brdf: lambertian plus an energy normalized lobe around the 
+// mirror direction of the outgoing one (wo, towards the previous vertex)
+vec3 brdf(
+	const in Material m
+,	const in vec3 n
+,	const in vec3 wo
+,	const in vec3 wi)
+{
+	vec3 f = m.diffuse / PI;
+	if(specularProbability(m) > 0.0)
+		f += m.specular * (m.exponent + 2.0) / (2.0 * PI) * pow(max(dot(reflect(-wo, n), wi), 0.0), m.exponent);
+
+	return f;
+}
+
+// pdf of sampleBrdf() for the direction, in solid angle
+float brdfPdf(
+	const in Material m
+,	const in vec3 n
+,	const in vec3 wo
+,	const in vec3 wi)
+{
+	float p = specularProbability(m);
+	float pdf = (1.0 - p) * max(dot(n, wi), 0.0) / PI;
+
+	if(p > 0.0)
+		pdf += p * (m.exponent + 1.0) / (2.0 * PI) * pow(max(dot(reflect(-wo, n), wi), 0.0), m.exponent);
+
+	return pdf;
+}
+
+// samples the next direction (wi) by the brdf, selecting a lobe by u.x: 
+// cosine distributed for the diffuse one, cosine power distributed around 
+// the mirror direction for the phong one. Returns the path weight, the brdf
+// times cosine over the pdf of both lobes - the albedo for diffuse surfaces.
+vec3 sampleBrdf(
+	const in Material m
+,	const in vec3 n
+,	const in mat3 tangentspace
+,	const in vec3 wo
+,	vec2 u
+,	out vec3 wi
+,	out float pdf)
+{
+	float p = specularProbability(m);
+	vec3 r = reflect(-wo, n);
+
+	if(u.x < p)
+	{
+		u.x /= p;
+
+		float c = pow(u.x, 1.0 / (m.exponent + 1.0));
+		float s = sqrt(max(0.0, 1.0 - c * c));
+
+		wi = basis(r) * vec3(s * cos(2.0 * PI * u.y), c, s * sin(2.0 * PI * u.y));
+	}
+	else
+	{
+		u.x = (u.x - p) / (1.0 - p);
+		wi = tangentspace * cosineHemisphere(u);
+	}
+
+	pdf = brdfPdf(m, n, wo, wi);
+
+	float cosine = dot(n, wi);
+	if(cosine <= 0.0)
+		return vec3(0.0);
+
+	if(p == 0.0)
+		return m.diffuse;
+
+	return brdf(m, n, wo, wi) * cosine / pdf;
+}
@@ -1,18 +1,12 @@
-#version 140
-
-uniform mat4 transform;
-
-uniform int frame;
+#version 150
 
 in vec3 a_vertex;
 
-out vec2 v_uv;
-out vec3 v_ray;
+out vec3 g_vertex;
 
 void main()
 {
-    v_uv   = a_vertex.xy * 0.5 + 0.5;
-    v_ray  = (transform * vec4(a_vertex, 1.0)).xyz;
+    g_vertex = a_vertex;
 
     gl_Position = vec4(a_vertex, 1.0);
 }
\ No newline at end of file